@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "wrapfs.h"
+
+/*
+ * Read-through cache tier (cache_dir= and cache_size=).
+ *
+ * The first read of a regular file queues a copy of it, whole, from the
+ * lower file into an anonymous O_TMPFILE file in cache_dir, which
+ * normally lives on fast local disk.  The copy is made by a per-mount
+ * work item; readers keep going to the lower until it is done.  Later
+ * reads, and read-only or private mmaps, are served from that copy for
+ * as long as the lower inode's mtime, ctime and size still match what
+ * they were when the copy was made.  Writes and truncates through wrapfs
+ * drop the copy right away; changes made on the lower directly are
+ * noticed as soon as the lower file system itself knows about them (for
+ * NFS: its attribute cache).  A file that is seen to change is not copied
+ * again for a while, the longer the more often it changed, so that files
+ * being written to aren't copied over and over.
+ *
+ * Readers find the copy through the upper inode without locks or
+ * reference counts: entries are freed only after an SRCU grace period of
+ * the mount, and readers stay in an SRCU read-side section for as long
+ * as they use the cache file (wrapfs_cache_get() to wrapfs_cache_put()).
+ *
+ * The copies live in memory only through their open files, so nothing
+ * is left behind in cache_dir after a crash or umount.  Their total size
+ * is kept within cache_size by a clock (second chance) sweep over all
+ * entries of the mount.  Files larger than an eighth of the budget are
+ * not cached, so that one big file can't flush everything else.
+ */
+
+#define WRAPFS_CACHE_BACKOFF_SHIFT	6	/* at most HZ << 6 */
+
+struct wrapfs_cache_entry {
+	struct list_head lru;		/* on cache_lru, or cache_fills */
+	struct inode *inode;		/* upper inode, NULL once detached */
+	struct file *file;		/* the cache file, NULL until filled */
+	struct file *lower_file;	/* to copy from, while queued */
+	loff_t size;
+	struct timespec mtime;		/* lower's, when the copy was made */
+	struct timespec ctime;
+	bool referenced;		/* clock bit */
+	struct rcu_head rcu;
+};
+
+static bool wrapfs_cache_valid(struct wrapfs_cache_entry *ce,
+			       struct inode *lower_inode)
+{
+	return timespec_equal(&ce->mtime, &lower_inode->i_mtime) &&
+		timespec_equal(&ce->ctime, &lower_inode->i_ctime) &&
+		ce->size == i_size_read(lower_inode);
+}
+
+static bool wrapfs_cache_fits(struct wrapfs_sb_info *sbinfo, loff_t size)
+{
+	return size && size <= sbinfo->cache_size / 8;
+}
+
+static void wrapfs_cache_free_rcu(struct rcu_head *head)
+{
+	struct wrapfs_cache_entry *ce =
+		container_of(head, struct wrapfs_cache_entry, rcu);
+
+	if (ce->file)
+		fput(ce->file);
+	if (ce->lower_file)
+		fput(ce->lower_file);
+	kfree(ce);
+}
+
+/*
+ * Unlink @ce from its inode and the mount and free it once no reader can
+ * see it any more.  Caller holds cache_lock.
+ */
+static void __wrapfs_cache_detach(struct wrapfs_sb_info *sbinfo,
+				  struct wrapfs_cache_entry *ce)
+{
+	WRAPFS_I(ce->inode)->cache = NULL;
+	ce->inode = NULL;
+	list_del_init(&ce->lru);
+	if (ce->file)
+		sbinfo->cache_used -= ce->size;
+	call_srcu(&sbinfo->cache_srcu, &ce->rcu, wrapfs_cache_free_rcu);
+}
+
+/* the lower changed under the copy: don't copy it again right away */
+static void __wrapfs_cache_backoff(struct wrapfs_inode_info *info)
+{
+	unsigned int shift = min_t(unsigned int, info->cache_stale,
+				   WRAPFS_CACHE_BACKOFF_SHIFT);
+
+	WRITE_ONCE(info->cache_retry, jiffies + (HZ << shift));
+	info->cache_stale++;
+}
+
+/*
+ * Make room for @size more bytes, clock style: recently used entries
+ * get their bit cleared and go round once more, the others are evicted.
+ */
+static void __wrapfs_cache_shrink(struct wrapfs_sb_info *sbinfo,
+				  loff_t size)
+{
+	struct wrapfs_cache_entry *ce;
+
+	while (sbinfo->cache_used + size > sbinfo->cache_size &&
+	       !list_empty(&sbinfo->cache_lru)) {
+		ce = list_first_entry(&sbinfo->cache_lru,
+				      struct wrapfs_cache_entry, lru);
+		if (ce->referenced) {
+			ce->referenced = false;
+			list_move_tail(&ce->lru, &sbinfo->cache_lru);
+			continue;
+		}
+		__wrapfs_cache_detach(sbinfo, ce);
+	}
+}
+
+static struct file *wrapfs_cache_create(struct wrapfs_sb_info *sbinfo)
+{
+	return file_open_root(sbinfo->cache_path.dentry,
+			      sbinfo->cache_path.mnt, ".",
+			      O_TMPFILE | O_RDWR | O_LARGEFILE, 0600);
+}
+
+/* copy the lower file of @ce into a new cache file */
+static struct file *wrapfs_cache_copy(struct wrapfs_sb_info *sbinfo,
+				      struct wrapfs_cache_entry *ce)
+{
+	struct file *lower_file = ce->lower_file;
+	const struct cred *old_cred;
+	struct file *cache_file;
+	loff_t pos = 0, out_pos = 0;
+	long bytes;
+
+	/* the cache belongs to whoever mounted us */
+	old_cred = override_creds(sbinfo->cache_cred);
+	cache_file = wrapfs_cache_create(sbinfo);
+	if (IS_ERR(cache_file))
+		goto out;
+
+	file_start_write(cache_file);
+	while (pos < ce->size && READ_ONCE(ce->inode)) {
+		bytes = do_splice_direct(lower_file, &pos, cache_file,
+					 &out_pos, ce->size - pos, 0);
+		if (bytes <= 0)
+			break;
+	}
+	file_end_write(cache_file);
+
+	/* short copy, invalidated, or the lower changed under us */
+	if (pos != ce->size ||
+	    !wrapfs_cache_valid(ce, file_inode(lower_file))) {
+		fput(cache_file);
+		cache_file = ERR_PTR(-ESTALE);
+	}
+out:
+	revert_creds(old_cred);
+	return cache_file;
+}
+
+/* fill the entries queued by wrapfs_cache_get(), one at a time */
+void wrapfs_cache_work(struct work_struct *work)
+{
+	struct wrapfs_sb_info *sbinfo =
+		container_of(work, struct wrapfs_sb_info, cache_work);
+	struct wrapfs_cache_entry *ce;
+	struct file *cache_file;
+
+	spin_lock(&sbinfo->cache_lock);
+	while (!list_empty(&sbinfo->cache_fills)) {
+		ce = list_first_entry(&sbinfo->cache_fills,
+				      struct wrapfs_cache_entry, lru);
+		/* off the list: ours until we put it back under the lock */
+		list_del_init(&ce->lru);
+		spin_unlock(&sbinfo->cache_lock);
+
+		cache_file = wrapfs_cache_copy(sbinfo, ce);
+		fput(ce->lower_file);
+		ce->lower_file = NULL;
+
+		spin_lock(&sbinfo->cache_lock);
+		if (!ce->inode) {
+			/* the inode was evicted meanwhile */
+			if (!IS_ERR(cache_file))
+				ce->file = cache_file;
+			call_srcu(&sbinfo->cache_srcu, &ce->rcu,
+				  wrapfs_cache_free_rcu);
+			continue;
+		}
+		if (IS_ERR(cache_file)) {
+			__wrapfs_cache_backoff(WRAPFS_I(ce->inode));
+			__wrapfs_cache_detach(sbinfo, ce);
+			continue;
+		}
+		__wrapfs_cache_shrink(sbinfo, ce->size);
+		list_add_tail(&ce->lru, &sbinfo->cache_lru);
+		sbinfo->cache_used += ce->size;
+		/* publishes it to wrapfs_cache_get() */
+		smp_store_release(&ce->file, cache_file);
+	}
+	spin_unlock(&sbinfo->cache_lock);
+}
+
+/* queue a fill of the cache for @file, unless one is pending already */
+static void wrapfs_cache_queue(struct file *file)
+{
+	struct inode *inode = file_inode(file);
+	struct wrapfs_sb_info *sbinfo = WRAPFS_SB(inode->i_sb);
+	struct inode *lower_inode = wrapfs_lower_inode(inode);
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct wrapfs_cache_entry *ce;
+	struct file *lower_file;
+
+	lower_file = wrapfs_open_lower(file);
+	if (IS_ERR(lower_file))
+		return;
+
+	ce = kzalloc(sizeof(*ce), GFP_KERNEL);
+	if (!ce)
+		return;
+	INIT_LIST_HEAD(&ce->lru);
+	ce->inode = inode;
+	ce->lower_file = get_file(lower_file);
+	ce->mtime = lower_inode->i_mtime;
+	ce->ctime = lower_inode->i_ctime;
+	ce->size = i_size_read(lower_inode);
+
+	spin_lock(&sbinfo->cache_lock);
+	if (info->cache) {
+		/* lost a race with another reader */
+		spin_unlock(&sbinfo->cache_lock);
+		fput(ce->lower_file);
+		kfree(ce);
+		return;
+	}
+	rcu_assign_pointer(info->cache, ce);
+	list_add_tail(&ce->lru, &sbinfo->cache_fills);
+	spin_unlock(&sbinfo->cache_lock);
+
+	queue_work(system_unbound_wq, &sbinfo->cache_work);
+}
+
+/*
+ * Return the up to date cache file of @file, or NULL if @file is to be
+ * read from the lower; a fill of the cache may then have been started.
+ * A cache file returned can be used until wrapfs_cache_put(file, *idx),
+ * which must be called in the same task.
+ */
+struct file *wrapfs_cache_get(struct file *file, int *idx)
+{
+	struct inode *inode = file_inode(file);
+	struct wrapfs_sb_info *sbinfo = WRAPFS_SB(inode->i_sb);
+	struct inode *lower_inode = wrapfs_lower_inode(inode);
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct wrapfs_cache_entry *ce;
+	struct file *cache_file;
+
+	if (!wrapfs_cache_enabled(sbinfo) || !S_ISREG(inode->i_mode) ||
+	    (file->f_flags & O_DIRECT))
+		return NULL;
+
+	*idx = srcu_read_lock(&sbinfo->cache_srcu);
+	ce = srcu_dereference(info->cache, &sbinfo->cache_srcu);
+	if (!ce)
+		goto out_miss;
+	cache_file = smp_load_acquire(&ce->file);
+	if (!cache_file)
+		goto out_unlock;	/* still being filled */
+	if (likely(wrapfs_cache_valid(ce, lower_inode))) {
+		if (!READ_ONCE(ce->referenced))
+			WRITE_ONCE(ce->referenced, true);
+		return cache_file;
+	}
+	srcu_read_unlock(&sbinfo->cache_srcu, *idx);
+
+	spin_lock(&sbinfo->cache_lock);
+	if (info->cache == ce) {
+		__wrapfs_cache_backoff(info);
+		__wrapfs_cache_detach(sbinfo, ce);
+	}
+	spin_unlock(&sbinfo->cache_lock);
+	return NULL;
+
+out_miss:
+	srcu_read_unlock(&sbinfo->cache_srcu, *idx);
+	if (time_before(jiffies, READ_ONCE(info->cache_retry)) ||
+	    !wrapfs_cache_fits(sbinfo, i_size_read(lower_inode)))
+		return NULL;
+	wrapfs_cache_queue(file);
+	return NULL;
+out_unlock:
+	srcu_read_unlock(&sbinfo->cache_srcu, *idx);
+	return NULL;
+}
+
+/* done with the cache file returned by wrapfs_cache_get() */
+void wrapfs_cache_put(struct file *file, int idx)
+{
+	srcu_read_unlock(&WRAPFS_SB(file_inode(file)->i_sb)->cache_srcu,
+			 idx);
+}
+
+/*
+ * Unlink the cache entry of @inode, if any.  A fill in progress is
+ * abandoned: wrapfs_cache_copy() stops, and wrapfs_cache_work() frees
+ * the entry.  Caller holds cache_lock.
+ */
+static void __wrapfs_cache_unlink(struct wrapfs_sb_info *sbinfo,
+				  struct inode *inode)
+{
+	struct wrapfs_cache_entry *ce = WRAPFS_I(inode)->cache;
+
+	if (ce && !ce->file && list_empty(&ce->lru)) {
+		/* being filled: wrapfs_cache_work() frees it */
+		WRAPFS_I(inode)->cache = NULL;
+		WRITE_ONCE(ce->inode, NULL);
+	} else if (ce) {
+		__wrapfs_cache_detach(sbinfo, ce);
+	}
+}
+
+/* the upper inode is going away */
+void wrapfs_cache_drop(struct inode *inode)
+{
+	struct wrapfs_sb_info *sbinfo = WRAPFS_SB(inode->i_sb);
+
+	if (!WRAPFS_I(inode)->cache)
+		return;
+
+	spin_lock(&sbinfo->cache_lock);
+	__wrapfs_cache_unlink(sbinfo, inode);
+	spin_unlock(&sbinfo->cache_lock);
+}
+
+/*
+ * @inode was written to or truncated through wrapfs.  Drop its copy
+ * now, rather than trusting the lower timestamps to tell: they may not
+ * change within their granularity, or not before the data lands.  The
+ * timestamps are left to catch changes made on the lower directly.
+ * Called after the lower write, so a fill racing with it is abandoned.
+ */
+void wrapfs_cache_invalidate(struct inode *inode)
+{
+	struct wrapfs_sb_info *sbinfo = WRAPFS_SB(inode->i_sb);
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+
+	if (!READ_ONCE(info->cache))
+		return;
+
+	spin_lock(&sbinfo->cache_lock);
+	if (info->cache) {
+		__wrapfs_cache_backoff(info);
+		__wrapfs_cache_unlink(sbinfo, inode);
+	}
+	spin_unlock(&sbinfo->cache_lock);
+}
+
+int wrapfs_cache_set_dir(struct wrapfs_sb_info *sbinfo, const char *name)
+{
+	int err;
+
+	/* the last cache_dir= given wins */
+	wrapfs_cache_fini(sbinfo);
+	sbinfo->cache_path.mnt = NULL;
+	err = kern_path(name, LOOKUP_FOLLOW | LOOKUP_DIRECTORY,
+			&sbinfo->cache_path);
+	if (err) {
+		printk(KERN_ERR "wrapfs: error accessing cache directory "
+		       "'%s'\n", name);
+		return err;
+	}
+	sbinfo->cache_cred = get_current_cred();
+	return 0;
+}
+
+/*
+ * All inodes, and with them all cache entries, are gone by now; at
+ * umount, so are the fill work and the SRCU callbacks.
+ */
+void wrapfs_cache_fini(struct wrapfs_sb_info *sbinfo)
+{
+	if (!sbinfo->cache_path.mnt)
+		return;
+	path_put(&sbinfo->cache_path);
+	put_cred(sbinfo->cache_cred);
+}
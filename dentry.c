@@ -20,23 +20,49 @@ static int wrapfs_d_revalidate(struct dentry *dentry, unsigned int flags)
 {
 	struct path lower_path;
 	struct dentry *lower_dentry;
+	struct inode *inode;
 	int err = 1;
 
-	if (flags & LOOKUP_RCU)
-		return -ECHILD;
+	/*
+	 * RCU-walk can't take references, but our dentry info and the
+	 * lower dentry are only freed after a grace period, so they can
+	 * be looked at; the lower ->d_revalidate sees LOOKUP_RCU as well
+	 * and returns -ECHILD if it has to block.
+	 */
+	if (flags & LOOKUP_RCU) {
+		struct wrapfs_dentry_info *info = READ_ONCE(dentry->d_fsdata);
+
+		if (!info)
+			return -ECHILD;
+		lower_dentry = READ_ONCE(info->lower_path.dentry);
+		if (!lower_dentry)
+			return -ECHILD;
+		if (lower_dentry->d_flags & DCACHE_OP_REVALIDATE)
+			err = lower_dentry->d_op->d_revalidate(lower_dentry,
+							       flags);
+		inode = d_inode_rcu(dentry);
+		goto refresh;
+	}
 
 	wrapfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
-	if (!(lower_dentry->d_flags & DCACHE_OP_REVALIDATE))
-		goto out;
-	err = lower_dentry->d_op->d_revalidate(lower_dentry, flags);
-out:
+	if (lower_dentry->d_flags & DCACHE_OP_REVALIDATE)
+		err = lower_dentry->d_op->d_revalidate(lower_dentry, flags);
 	wrapfs_put_lower_path(dentry, &lower_path);
+	inode = d_inode(dentry);
+
+refresh:
+	if (err > 0 && inode && wrapfs_test_opt(dentry->d_sb, ATTR_LAZY))
+		wrapfs_refresh_attrs(inode);
 	return err;
 }
 
 static void wrapfs_d_release(struct dentry *dentry)
 {
+	/* private data allocation may have failed */
+	if (!dentry->d_fsdata)
+		return;
+
 	/* release and reset the lower paths */
 	wrapfs_put_reset_lower_path(dentry);
 	free_dentry_private_data(dentry);
@@ -12,20 +12,37 @@
 
 #include "wrapfs.h"
 
+static struct file *wrapfs_read_lower(struct file *file);
+static struct file *wrapfs_own_lower(struct file *file);
+
 static ssize_t wrapfs_read(struct file *file, char __user *buf,
 			   size_t count, loff_t *ppos)
 {
-	int err;
-	struct file *lower_file;
+	int err, idx;
+	struct file *lower_file, *cache_file;
 	struct dentry *dentry = file->f_path.dentry;
+	struct wrapfs_sb_info *sbinfo = WRAPFS_SB(dentry->d_sb);
 
-	lower_file = wrapfs_lower_file(file);
+	wrapfs_stat_inc(sbinfo, WRAPFS_STAT_READ);
+	wrapfs_stage_flush(file_inode(file));
+	cache_file = wrapfs_cache_get(file, &idx);
+	if (cache_file) {
+		err = vfs_read(cache_file, buf, count, ppos);
+		wrapfs_cache_put(file, idx);
+		goto out;
+	}
+
+	lower_file = wrapfs_read_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
 	err = vfs_read(lower_file, buf, count, ppos);
 	/* update our inode atime upon a successful lower read */
-	if (err >= 0)
-		fsstack_copy_attr_atime(d_inode(dentry),
-					file_inode(lower_file));
-
+	if (err >= 0 && !wrapfs_test_opt(dentry->d_sb, ATTR_LAZY))
+		wrapfs_copy_attr_atime(d_inode(dentry),
+				       file_inode(lower_file));
+out:
+	if (err > 0)
+		wrapfs_stat_add(sbinfo, WRAPFS_STAT_READ_BYTES, err);
 	return err;
 }
 
@@ -33,20 +50,34 @@ static ssize_t wrapfs_write(struct file *file, const char __user *buf,
 			    size_t count, loff_t *ppos)
 {
 	int err;
-
+	struct iovec iov = { .iov_base = (void __user *)buf, .iov_len = count };
+	struct iov_iter iter;
 	struct file *lower_file;
 	struct dentry *dentry = file->f_path.dentry;
+	struct wrapfs_sb_info *sbinfo = WRAPFS_SB(dentry->d_sb);
+
+	wrapfs_stat_inc(sbinfo, WRAPFS_STAT_WRITE);
+	/* small writes may be staged, see staging.c */
+	iov_iter_init(&iter, WRITE, &iov, 1, count);
+	err = wrapfs_stage_write(file, &iter, ppos);
+	if (err)
+		goto out;
 
 	lower_file = wrapfs_lower_file(file);
 	err = vfs_write(lower_file, buf, count, ppos);
+	wrapfs_xattr_cache_clear(d_inode(dentry));
+	wrapfs_cache_invalidate(d_inode(dentry));
+	wrapfs_attr_changed(d_inode(dentry));
 	/* update our inode times+sizes upon a successful lower write */
-	if (err >= 0) {
+	if (err >= 0 && !wrapfs_test_opt(dentry->d_sb, ATTR_LAZY)) {
 		fsstack_copy_inode_size(d_inode(dentry),
 					file_inode(lower_file));
 		fsstack_copy_attr_times(d_inode(dentry),
 					file_inode(lower_file));
 	}
-
+out:
+	if (err > 0)
+		wrapfs_stat_add(sbinfo, WRAPFS_STAT_WRITE_BYTES, err);
 	return err;
 }
 
@@ -54,6 +85,8 @@ struct wrapfs_dir_context {
 	struct dir_context wrapfs_ctx;
 	struct dir_context *caller_ctx;
 	struct super_block *sb;
+	struct file *file;
+	struct wrapfs_prefetch_dir *prefetch;	/* names to prefetch */
 };
 
 static int wrapfs_filldir(struct dir_context *ctx, const char *lower_name, int
@@ -69,6 +102,12 @@ static int wrapfs_filldir(struct dir_context *ctx, const char *lower_name, int
 	if (wrapfs_is_hidden(WRAPFS_SB(buf->sb), lower_name, ino) == 0) {
 		err = !dir_emit(buf->caller_ctx, lower_name, lower_namelen, ino,
 				d_type);
+		if (!err && WRAPFS_SB(buf->sb)->readdir_prefetch)
+			wrapfs_prefetch(buf->file, &buf->prefetch,
+					lower_name, lower_namelen);
+	} else {
+		wrapfs_stat_inc(WRAPFS_SB(buf->sb),
+				WRAPFS_STAT_READDIR_FILTERED);
 	}
 	return err;
 }
@@ -82,16 +121,21 @@ static int wrapfs_readdir(struct file *file, struct dir_context *ctx)
 		.wrapfs_ctx.actor = wrapfs_filldir,
 		.caller_ctx = ctx,
 		.sb = dentry->d_sb,
+		.file = file,
 	};
 
-	lower_file = wrapfs_lower_file(file);
+	lower_file = wrapfs_open_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
 	err = iterate_dir(lower_file, &buf.wrapfs_ctx);
 	ctx->pos = buf.wrapfs_ctx.pos;
+	if (buf.prefetch)
+		wrapfs_prefetch_submit(file, buf.prefetch);
 	if (err < 0)
 		goto out;
-	if (err >= 0)		/* copy the atime */
-		fsstack_copy_attr_atime(d_inode(dentry),
-					file_inode(lower_file));
+	if (!wrapfs_test_opt(dentry->d_sb, ATTR_LAZY)) /* copy the atime */
+		wrapfs_copy_attr_atime(d_inode(dentry),
+				       file_inode(lower_file));
 
 out:
 	return err;
@@ -173,7 +217,9 @@ static long wrapfs_unlocked_ioctl(struct file *file, unsigned int cmd,
 		err = wrapfs_handle_ioctl(file, cmd, arg);
 		goto out;
 	}
-	lower_file = wrapfs_lower_file(file);
+	lower_file = wrapfs_own_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
 
 	/* XXX: use vfs_ioctl if/when VFS exports it */
 	if (!lower_file || !lower_file->f_op)
@@ -200,7 +246,9 @@ static long wrapfs_compat_ioctl(struct file *file, unsigned int cmd,
 		err = wrapfs_handle_ioctl(file, cmd, arg);
 		goto out;
 	}
-	lower_file = wrapfs_lower_file(file);
+	lower_file = wrapfs_own_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
 
 	/* XXX: use vfs_ioctl if/when VFS exports it */
 	if (!lower_file || !lower_file->f_op)
@@ -215,14 +263,40 @@ out:
 
 static int wrapfs_mmap(struct file *file, struct vm_area_struct *vma)
 {
-	int err = 0;
+	int err = 0, idx;
 	bool willwrite;
-	struct file *lower_file;
+	struct file *lower_file, *cache_file;
 	const struct vm_operations_struct *saved_vm_ops = NULL;
 
+	wrapfs_stage_flush(file_inode(file));
+
 	/* this might be deferred to mmap's writepage */
 	willwrite = ((vma->vm_flags | VM_SHARED | VM_WRITE) == vma->vm_flags);
 
+	/*
+	 * Mappings that can never write back to the file are handed over
+	 * to the cache copy, if there is one, the same way mmap=passthrough
+	 * hands them to the lower file.  Like any mapping of a snapshot,
+	 * they keep the data they were made with.
+	 */
+	if (!(vma->vm_flags & VM_SHARED) || !(vma->vm_flags & VM_MAYWRITE)) {
+		cache_file = wrapfs_cache_get(file, &idx);
+		if (cache_file) {
+			get_file(cache_file);
+			wrapfs_cache_put(file, idx);
+			vma->vm_file = cache_file;
+			err = cache_file->f_op->mmap(cache_file, vma);
+			if (err) {
+				vma->vm_file = file;
+				fput(cache_file);
+				goto out;
+			}
+			fput(file);
+			file_accessed(file);
+			goto out;
+		}
+	}
+
 	/*
 	 * File systems which do not implement ->writepage may use
 	 * generic_file_readonly_mmap as their ->mmap op.  If you call
@@ -233,7 +307,9 @@ static int wrapfs_mmap(struct file *file, struct vm_area_struct *vma)
 	 * not, return EINVAL (the same error that
 	 * generic_file_readonly_mmap returns in that case).
 	 */
-	lower_file = wrapfs_lower_file(file);
+	lower_file = wrapfs_open_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
 	if (willwrite && !lower_file->f_mapping->a_ops->writepage) {
 		err = -EINVAL;
 		printk(KERN_ERR "wrapfs: lower file system does not "
@@ -241,6 +317,29 @@ static int wrapfs_mmap(struct file *file, struct vm_area_struct *vma)
 		goto out;
 	}
 
+	/*
+	 * mmap=passthrough: hand the vma over to the lower file for good.
+	 * Faults, fault-around, readahead and writeback then run in the
+	 * lower fs without going through wrapfs_vm_ops, and the upper
+	 * mapping never sees a page.  Hidden/blocked files never get this
+	 * far, as they are refused at lookup/open time.  mmap_region() took
+	 * a reference to the upper file for vm_file; it is exchanged for
+	 * one on the lower file.
+	 */
+	if (wrapfs_test_opt(file_inode(file)->i_sb, MMAP_PASSTHROUGH)) {
+		vma->vm_file = get_file(lower_file);
+		err = lower_file->f_op->mmap(lower_file, vma);
+		if (err) {
+			vma->vm_file = file;
+			fput(lower_file);
+			printk(KERN_ERR "wrapfs: lower mmap failed %d\n", err);
+			goto out;
+		}
+		fput(file);
+		file_accessed(file);
+		goto out;
+	}
+
 	/*
 	 * find and save lower vm_ops.
 	 *
@@ -255,6 +354,12 @@ static int wrapfs_mmap(struct file *file, struct vm_area_struct *vma)
 		saved_vm_ops = vma->vm_ops; /* save: came from lower ->mmap */
 	}
 
+	if (!WRAPFS_F(file)->lower_vm_ops) /* save for our ->fault */
+		WRAPFS_F(file)->lower_vm_ops = saved_vm_ops;
+	err = wrapfs_init_lower_vma(vma, lower_file);
+	if (err)
+		goto out;
+
 	/*
 	 * Next 3 lines are all I need from generic_file_mmap.  I definitely
 	 * don't want its test for ->readpage which returns -ENOEXEC.
@@ -263,21 +368,190 @@ static int wrapfs_mmap(struct file *file, struct vm_area_struct *vma)
 	vma->vm_ops = &wrapfs_vm_ops;
 
 	file->f_mapping->a_ops = &wrapfs_aops; /* set our aops */
-	if (!WRAPFS_F(file)->lower_vm_ops) /* save for our ->fault */
-		WRAPFS_F(file)->lower_vm_ops = saved_vm_ops;
 
 out:
 	return err;
 }
 
+/* open the lower object for @file */
+static struct file *wrapfs_do_open_lower(struct file *file)
+{
+	struct inode *inode = file_inode(file);
+	struct file *lower_file;
+	struct path lower_path;
+
+	wrapfs_get_lower_path(file->f_path.dentry, &lower_path);
+	lower_file = dentry_open(&lower_path, file->f_flags, file->f_cred);
+	path_put(&lower_path);
+	if (IS_ERR(lower_file))
+		return lower_file;
+	/* start out in line with the upper file, see wrapfs_read_lower() */
+	lower_file->f_ra.ra_pages = WRAPFS_SB(inode->i_sb)->bdi.ra_pages;
+
+	return lower_file;
+}
+
+/* open flags that do_dentry_open() strips from f_flags after ->open */
+#define WRAPFS_OPEN_ONLY_FLAGS	(O_CREAT | O_EXCL | O_NOCTTY | O_TRUNC)
+
+/*
+ * Deferred read-only opens of a regular file share one lower file per
+ * inode, instead of each running the lower open path.  Only lowers on
+ * a block device qualify: network and FUSE lowers do protocol work in
+ * ->open (NFS close-to-open revalidation, open handles) that every
+ * open must see.  A file shares only with opens made with the very
+ * same credentials and flags, and only while its readahead is at the
+ * defaults; wrapfs_own_lower() gives it a lower file of its own before
+ * anything that would be visible to the other users (locks, leases,
+ * fasync, ioctls, readahead hints).  The inode holds no reference: the
+ * shared file goes away with the last upper file using it.
+ */
+static bool wrapfs_may_share_lower(struct file *file)
+{
+	struct inode *inode = file_inode(file);
+
+	return S_ISREG(inode->i_mode) &&
+		(wrapfs_lower_super(inode->i_sb)->s_type->fs_flags &
+		 FS_REQUIRES_DEV);
+}
+
+static bool wrapfs_can_share_lower(struct file *file,
+				   struct file *lower_file)
+{
+	return lower_file->f_cred == file->f_cred &&
+		lower_file->f_flags ==
+		(file->f_flags & ~WRAPFS_OPEN_ONLY_FLAGS) &&
+		lower_file->f_ra.ra_pages == file->f_ra.ra_pages &&
+		!(file->f_mode & FMODE_RANDOM);
+}
+
+static struct file *wrapfs_get_shared_lower(struct file *file, bool *shared)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(file_inode(file));
+	struct file *lower_file;
+
+	spin_lock(&info->lock);
+	lower_file = info->lower_ro_file;
+	if (lower_file && wrapfs_can_share_lower(file, lower_file)) {
+		get_file(lower_file);
+		info->lower_ro_users++;
+		*shared = true;
+	} else {
+		lower_file = NULL;
+	}
+	spin_unlock(&info->lock);
+	if (lower_file)
+		return lower_file;
+
+	lower_file = wrapfs_do_open_lower(file);
+	if (IS_ERR(lower_file))
+		return lower_file;
+
+	spin_lock(&info->lock);
+	if (!info->lower_ro_file &&
+	    wrapfs_can_share_lower(file, lower_file)) {
+		info->lower_ro_file = lower_file;
+		info->lower_ro_users = 1;
+		*shared = true;
+	}
+	spin_unlock(&info->lock);
+
+	return lower_file;
+}
+
+static void wrapfs_put_shared_lower(struct inode *inode,
+				    struct file *lower_file)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+
+	spin_lock(&info->lock);
+	if (info->lower_ro_file == lower_file && !--info->lower_ro_users)
+		info->lower_ro_file = NULL;
+	spin_unlock(&info->lock);
+	fput(lower_file);
+}
+
+/*
+ * Slow path of wrapfs_open_lower(): instantiate the lower file of a
+ * deferred open.  Concurrent first users may both get here; the loser
+ * of the cmpxchg drops its lower file and uses the winner's.
+ */
+struct file *__wrapfs_open_lower(struct file *file)
+{
+	struct file *lower_file, *old;
+	bool shared = false;
+
+	if (wrapfs_may_share_lower(file))
+		lower_file = wrapfs_get_shared_lower(file, &shared);
+	else
+		lower_file = wrapfs_do_open_lower(file);
+	if (IS_ERR(lower_file))
+		return lower_file;
+
+	old = cmpxchg(&WRAPFS_F(file)->lower_file, NULL, lower_file);
+	if (old) {
+		if (shared)
+			wrapfs_put_shared_lower(file_inode(file), lower_file);
+		else
+			fput(lower_file);
+		return old;
+	}
+	/* kept until release, so racing users of the old pointer are safe */
+	if (shared)
+		WRAPFS_F(file)->lower_shared = lower_file;
+	return lower_file;
+}
+
+/*
+ * The lower file of @file, which other upper files don't use.  A file
+ * on the shared lower file gets a private one, which stays for the
+ * rest of its life.
+ */
+static struct file *wrapfs_own_lower(struct file *file)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(file_inode(file));
+	struct file *lower_file, *own, *old;
+
+	lower_file = wrapfs_open_lower(file);
+	if (IS_ERR(lower_file) || lower_file != READ_ONCE(info->lower_ro_file))
+		return lower_file;
+
+	own = wrapfs_do_open_lower(file);
+	if (IS_ERR(own))
+		return own;
+	old = cmpxchg(&WRAPFS_F(file)->lower_file, lower_file, own);
+	if (old != lower_file) {
+		/* somebody else unshared it first */
+		fput(own);
+		return old;
+	}
+	return own;
+}
+
+/*
+ * Read-only opens don't need the lower file until they do I/O, and
+ * many never do (fstat, wrapfsctl ioctls, open/close probes), so the
+ * lower open is deferred to the first operation that needs it; see
+ * wrapfs_open_lower().  Writers, O_DIRECT opens which the lower fs may
+ * refuse, and O_TRUNC opens, whose truncate hands the file to the
+ * lower's ->setattr, are opened eagerly so that errors surface at open
+ * time.
+ */
+static bool wrapfs_defer_open(struct file *file)
+{
+	return (file->f_flags & O_ACCMODE) == O_RDONLY &&
+		!(file->f_flags & (O_DIRECT | O_TRUNC));
+}
+
 static int wrapfs_open(struct inode *inode, struct file *file)
 {
 	int err = 0;
 	struct file *lower_file = NULL;
-	struct path lower_path;
 
-	/* don't open unhashed/deleted files */
-	if (d_unhashed(file->f_path.dentry)) {
+	wrapfs_stat_inc(WRAPFS_SB(inode->i_sb), WRAPFS_STAT_OPEN);
+	/* don't open unhashed/deleted files, unless just made by O_TMPFILE */
+	if (d_unhashed(file->f_path.dentry) &&
+	    !(file->f_flags & __O_TMPFILE)) {
 		err = -ENOENT;
 		goto out_err;
 	}
@@ -289,21 +563,20 @@ static int wrapfs_open(struct inode *inode, struct file *file)
 		goto out_err;
 	}
 
+	if (wrapfs_defer_open(file)) {
+		/* dentry_open() of the lower would have done this for us */
+		err = break_lease(wrapfs_lower_inode(inode), file->f_flags);
+		goto out;
+	}
+
 	/* open lower object and link wrapfs's file struct to lower's */
-	wrapfs_get_lower_path(file->f_path.dentry, &lower_path);
-	lower_file = dentry_open(&lower_path, file->f_flags, current_cred());
-	path_put(&lower_path);
-	if (IS_ERR(lower_file)) {
+	lower_file = wrapfs_do_open_lower(file);
+	if (IS_ERR(lower_file))
 		err = PTR_ERR(lower_file);
-		lower_file = wrapfs_lower_file(file);
-		if (lower_file) {
-			wrapfs_set_lower_file(file, NULL);
-			fput(lower_file); /* fput calls dput for lower_dentry */
-		}
-	} else {
+	else
 		wrapfs_set_lower_file(file, lower_file);
-	}
 
+out:
 	if (err)
 		kfree(WRAPFS_F(file));
 	else
@@ -312,50 +585,116 @@ out_err:
 	return err;
 }
 
+/* ->open for finish_open() when the lower file is already open */
+static int wrapfs_open_prepared(struct inode *inode, struct file *file)
+{
+	wrapfs_stat_inc(WRAPFS_SB(inode->i_sb), WRAPFS_STAT_OPEN);
+	fsstack_copy_attr_all(inode, wrapfs_lower_inode(inode));
+	return 0;
+}
+
+/*
+ * Complete an ->atomic_open whose lower file has already been opened by
+ * the lower file system.  Consumes the reference on @lower_file.
+ */
+int wrapfs_finish_open(struct file *file, struct dentry *dentry,
+		       struct file *lower_file, int *opened)
+{
+	int err;
+
+	file->private_data =
+		kzalloc(sizeof(struct wrapfs_file_info), GFP_KERNEL);
+	if (!WRAPFS_F(file)) {
+		fput(lower_file);
+		return -ENOMEM;
+	}
+	wrapfs_set_lower_file(file, lower_file);
+
+	err = finish_open(file, dentry, wrapfs_open_prepared, opened);
+	if (err) {
+		kfree(WRAPFS_F(file));
+		file->private_data = NULL;
+		fput(lower_file);
+	}
+	return err;
+}
+
 static int wrapfs_flush(struct file *file, fl_owner_t id)
 {
-	int err = 0;
+	int err = 0, stage_err;
 	struct file *lower_file = NULL;
 
 	lower_file = wrapfs_lower_file(file);
-	if (lower_file && lower_file->f_op && lower_file->f_op->flush) {
-		filemap_write_and_wait(file->f_mapping);
+	if (!lower_file)
+		return 0;
+
+	/* close() is a durability barrier for staged writes */
+	stage_err = wrapfs_stage_sync(file);
+
+	/* POSIX locks live on the lower inode, see wrapfs_lock() */
+	locks_remove_posix(lower_file, id);
+	if (lower_file->f_op && lower_file->f_op->flush) {
+		/*
+		 * Data lives in the lower page cache; the upper mapping is
+		 * normally empty, so don't pay for a writeback pass (and its
+		 * error checks) on every close unless it holds pages.
+		 */
+		if (file->f_mapping->nrpages)
+			filemap_write_and_wait(file->f_mapping);
 		err = lower_file->f_op->flush(lower_file, id);
 	}
 
-	return err;
+	return stage_err ? stage_err : err;
 }
 
 /* release all lower object references & free the file info structure */
 static int wrapfs_file_release(struct inode *inode, struct file *file)
 {
-	struct file *lower_file;
+	struct file *lower_file, *shared;
 
+	wrapfs_stage_release(file);
 	lower_file = wrapfs_lower_file(file);
+	shared = WRAPFS_F(file)->lower_shared;
 	if (lower_file) {
+		/* OFD locks; flocks and leases go with the lower file */
+		locks_remove_posix(lower_file, file);
 		wrapfs_set_lower_file(file, NULL);
-		fput(lower_file);
+		if (lower_file != shared)
+			fput(lower_file);
 	}
+	if (shared)
+		wrapfs_put_shared_lower(inode, shared);
 
 	kfree(WRAPFS_F(file));
 	return 0;
 }
 
+/*
+ * All data and metadata that matter live in the lower file system: the
+ * upper inode has no ->write_inode and the upper mapping no pages of its
+ * own.  So fsync forwards straight to the lower file for the requested
+ * range, instead of first running __generic_file_fsync() on the upper
+ * file, which took i_mutex and synced an upper inode that persists
+ * nothing.
+ */
 static int wrapfs_fsync(struct file *file, loff_t start, loff_t end,
 			int datasync)
 {
 	int err;
 	struct file *lower_file;
-	struct path lower_path;
-	struct dentry *dentry = file->f_path.dentry;
 
-	err = __generic_file_fsync(file, start, end, datasync);
+	lower_file = wrapfs_open_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
+	err = wrapfs_stage_sync(file);
 	if (err)
 		goto out;
-	lower_file = wrapfs_lower_file(file);
-	wrapfs_get_lower_path(dentry, &lower_path);
+	if (file->f_mapping->nrpages) {
+		err = filemap_write_and_wait_range(file->f_mapping, start, end);
+		if (err)
+			goto out;
+	}
 	err = vfs_fsync_range(lower_file, start, end, datasync);
-	wrapfs_put_lower_path(dentry, &lower_path);
 out:
 	return err;
 }
@@ -365,13 +704,133 @@ static int wrapfs_fasync(int fd, struct file *file, int flag)
 	int err = 0;
 	struct file *lower_file = NULL;
 
-	lower_file = wrapfs_lower_file(file);
+	lower_file = wrapfs_own_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
 	if (lower_file->f_op && lower_file->f_op->fasync)
 		err = lower_file->f_op->fasync(fd, lower_file, flag);
 
 	return err;
 }
 
+/*
+ * There is no ->fadvise to forward posix_fadvise() hints with, so they
+ * land in the upper file's readahead state: POSIX_FADV_SEQUENTIAL and
+ * NORMAL set its window, RANDOM sets FMODE_RANDOM.  Reads are served
+ * by the lower file's readahead, so carry both over before reading.
+ */
+static struct file *wrapfs_read_lower(struct file *file)
+{
+	struct file *lower_file;
+
+	lower_file = wrapfs_open_lower(file);
+	if (IS_ERR(lower_file) ||
+	    (lower_file->f_ra.ra_pages == file->f_ra.ra_pages &&
+	     !((lower_file->f_mode ^ file->f_mode) & FMODE_RANDOM)))
+		return lower_file;
+
+	/* leave the shared lower file at the defaults */
+	lower_file = wrapfs_own_lower(file);
+	if (IS_ERR(lower_file))
+		return lower_file;
+
+	lower_file->f_ra.ra_pages = file->f_ra.ra_pages;
+	spin_lock(&lower_file->f_lock);
+	if (file->f_mode & FMODE_RANDOM)
+		lower_file->f_mode |= FMODE_RANDOM;
+	else
+		lower_file->f_mode &= ~FMODE_RANDOM;
+	spin_unlock(&lower_file->f_lock);
+
+	return lower_file;
+}
+
+/*
+ * Locks and leases are taken on the lower file, so that they conflict
+ * with, and on network lowers are enforced against, every other user of
+ * the lower file system, and so that lower lease breaks reach knfsd and
+ * Samba.
+ */
+
+/* POSIX and OFD locks */
+static int wrapfs_lock(struct file *file, int cmd, struct file_lock *fl)
+{
+	int err;
+	struct file *lower_file;
+
+	lower_file = wrapfs_own_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
+
+	fl->fl_file = lower_file;
+	if (IS_GETLK(cmd))
+		err = vfs_test_lock(lower_file, fl);
+	else if (cmd == F_CANCELLK)
+		err = vfs_cancel_lock(lower_file, fl);
+	else
+		err = vfs_lock_file(lower_file, cmd, fl, NULL);
+	fl->fl_file = file;
+
+	return err;
+}
+
+static int wrapfs_flock(struct file *file, int cmd, struct file_lock *fl)
+{
+	int err;
+	struct file *lower_file;
+
+	lower_file = wrapfs_own_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
+
+	fl->fl_file = lower_file;
+	if (lower_file->f_op->flock)
+		err = lower_file->f_op->flock(lower_file, cmd, fl);
+	else
+		err = locks_lock_file_wait(lower_file, fl);
+	fl->fl_file = file;
+
+	return err;
+}
+
+static int wrapfs_setlease(struct file *file, long arg,
+			   struct file_lock **lease, void **priv)
+{
+	int err;
+	struct file *lower_file;
+
+	lower_file = wrapfs_own_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
+
+	if (lease && *lease)
+		(*lease)->fl_file = lower_file;
+	err = vfs_setlease(lower_file, arg, lease, priv);
+	/* a lease that wasn't inserted goes back to the caller */
+	if (lease && *lease)
+		(*lease)->fl_file = file;
+
+	return err;
+}
+
+/*
+ * Regular files only move the upper offset, but SEEK_END and friends
+ * need an up to date upper i_size, which attr_sync=lazy doesn't push
+ * after writes.
+ */
+static loff_t wrapfs_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct inode *inode = file_inode(file);
+
+	if (whence != SEEK_SET && whence != SEEK_CUR) {
+		wrapfs_stage_flush(inode);
+		if (wrapfs_test_opt(inode->i_sb, ATTR_LAZY))
+			wrapfs_refresh_attrs(inode);
+	}
+
+	return generic_file_llseek(file, offset, whence);
+}
+
 /*
  * Wrapfs cannot use generic_file_llseek as ->llseek, because it would
  * only set the offset of the upper file.  So we have to implement our
@@ -387,38 +846,151 @@ static loff_t wrapfs_file_llseek(struct file *file, loff_t offset, int whence)
 	if (err < 0)
 		goto out;
 
-	lower_file = wrapfs_lower_file(file);
+	lower_file = wrapfs_open_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
 	err = generic_file_llseek(lower_file, offset, whence);
 
 out:
 	return err;
 }
 
+/*
+ * Asynchronous kiocbs complete after ->read_iter/->write_iter have
+ * returned, so the caller's iocb cannot be borrowed for the lower file
+ * the way the synchronous path does it: the submitter could complete
+ * and free it while ki_filp still points at the lower file.  Give the
+ * lower file a kiocb of its own and complete the caller's one from its
+ * completion, so that AIO against the lower file stays asynchronous.
+ */
+struct wrapfs_aio_req {
+	struct kiocb iocb;
+	struct kiocb *orig_iocb;
+};
+
+static struct kmem_cache *wrapfs_aio_req_cachep;
+
+int wrapfs_init_aio_cache(void)
+{
+	wrapfs_aio_req_cachep =
+		kmem_cache_create("wrapfs_aio_req",
+				  sizeof(struct wrapfs_aio_req),
+				  0, SLAB_HWCACHE_ALIGN, NULL);
+
+	return wrapfs_aio_req_cachep ? 0 : -ENOMEM;
+}
+
+void wrapfs_destroy_aio_cache(void)
+{
+	if (wrapfs_aio_req_cachep)
+		kmem_cache_destroy(wrapfs_aio_req_cachep);
+}
+
+static void wrapfs_aio_put_req(struct wrapfs_aio_req *aio_req)
+{
+	kmem_cache_free(wrapfs_aio_req_cachep, aio_req);
+}
+
+static void wrapfs_aio_rw_complete(struct kiocb *iocb, long res, long res2)
+{
+	struct wrapfs_aio_req *aio_req = container_of(iocb,
+						      struct wrapfs_aio_req,
+						      iocb);
+	struct kiocb *orig_iocb = aio_req->orig_iocb;
+
+	orig_iocb->ki_pos = iocb->ki_pos;
+	wrapfs_aio_put_req(aio_req);
+	orig_iocb->ki_complete(orig_iocb, res, res2);
+}
+
+/*
+ * Submit an asynchronous @iocb against @lower_file.  No reference is
+ * taken on @lower_file: the submitter holds the upper file until the
+ * iocb completes, and the upper file pins the lower one.
+ */
+static ssize_t wrapfs_aio_rw(struct kiocb *iocb, struct iov_iter *iter,
+			     struct file *lower_file, int rw)
+{
+	ssize_t err;
+	struct wrapfs_aio_req *aio_req;
+
+	aio_req = kmem_cache_zalloc(wrapfs_aio_req_cachep, GFP_KERNEL);
+	if (!aio_req)
+		return -ENOMEM;
+
+	aio_req->orig_iocb = iocb;
+	aio_req->iocb.ki_filp = lower_file;
+	aio_req->iocb.ki_pos = iocb->ki_pos;
+	aio_req->iocb.ki_flags = iocb->ki_flags;
+	aio_req->iocb.ki_complete = wrapfs_aio_rw_complete;
+
+	if (rw == WRITE)
+		err = lower_file->f_op->write_iter(&aio_req->iocb, iter);
+	else
+		err = lower_file->f_op->read_iter(&aio_req->iocb, iter);
+
+	/* completed (or failed) inline: ->ki_complete will not be called */
+	if (err != -EIOCBQUEUED) {
+		iocb->ki_pos = aio_req->iocb.ki_pos;
+		wrapfs_aio_put_req(aio_req);
+	}
+	return err;
+}
+
 /*
  * Wrapfs read_iter, redirect modified iocb to lower read_iter
  */
 ssize_t
 wrapfs_read_iter(struct kiocb *iocb, struct iov_iter *iter)
 {
-	int err;
-	struct file *file = iocb->ki_filp, *lower_file;
+	int err, idx;
+	struct file *file = iocb->ki_filp, *lower_file, *cache_file;
+	struct wrapfs_sb_info *sbinfo = WRAPFS_SB(file_inode(file)->i_sb);
 
-	lower_file = wrapfs_lower_file(file);
+	wrapfs_stat_inc(sbinfo, WRAPFS_STAT_READ);
+	wrapfs_stage_flush(file_inode(file));
+
+	/* the cache copy is only read synchronously */
+	if (is_sync_kiocb(iocb)) {
+		cache_file = wrapfs_cache_get(file, &idx);
+		if (cache_file) {
+			iocb->ki_filp = cache_file;
+			err = cache_file->f_op->read_iter(iocb, iter);
+			iocb->ki_filp = file;
+			wrapfs_cache_put(file, idx);
+			goto out;
+		}
+	}
+
+	lower_file = wrapfs_read_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
 	if (!lower_file->f_op->read_iter) {
 		err = -EINVAL;
 		goto out;
 	}
 
-	get_file(lower_file); /* prevent lower_file from being released */
-	iocb->ki_filp = lower_file;
-	err = lower_file->f_op->read_iter(iocb, iter);
-	iocb->ki_filp = file;
-	fput(lower_file);
+	/*
+	 * No get_file() here: lower_file is only released from
+	 * wrapfs_file_release(), which cannot run while the upper file is
+	 * in use by this call.
+	 */
+	if (!is_sync_kiocb(iocb)) {
+		err = wrapfs_aio_rw(iocb, iter, lower_file, READ);
+	} else {
+		iocb->ki_filp = lower_file;
+		err = lower_file->f_op->read_iter(iocb, iter);
+		iocb->ki_filp = file;
+	}
 	/* update upper inode atime as needed */
-	if (err >= 0 || err == -EIOCBQUEUED)
-		fsstack_copy_attr_atime(d_inode(file->f_path.dentry),
-					file_inode(lower_file));
+	if ((err >= 0 || err == -EIOCBQUEUED) &&
+	    !wrapfs_test_opt(file->f_path.dentry->d_sb, ATTR_LAZY))
+		wrapfs_copy_attr_atime(d_inode(file->f_path.dentry),
+				       file_inode(lower_file));
 out:
+	/* bytes of queued async reads aren't known here */
+	if (err > 0)
+		wrapfs_stat_add(sbinfo, WRAPFS_STAT_READ_BYTES, err);
 	return err;
 }
 
@@ -430,6 +1002,17 @@ wrapfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 {
 	int err;
 	struct file *file = iocb->ki_filp, *lower_file;
+	struct wrapfs_sb_info *sbinfo = WRAPFS_SB(file_inode(file)->i_sb);
+
+	wrapfs_stat_inc(sbinfo, WRAPFS_STAT_WRITE);
+	/* small synchronous writes may be staged, see staging.c */
+	if (is_sync_kiocb(iocb)) {
+		err = wrapfs_stage_write(file, iter, &iocb->ki_pos);
+		if (err)
+			goto out;
+	} else {
+		wrapfs_stage_flush(file_inode(file));
+	}
 
 	lower_file = wrapfs_lower_file(file);
 	if (!lower_file->f_op->write_iter) {
@@ -437,24 +1020,33 @@ wrapfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
 		goto out;
 	}
 
-	get_file(lower_file); /* prevent lower_file from being released */
-	iocb->ki_filp = lower_file;
-	err = lower_file->f_op->write_iter(iocb, iter);
-	iocb->ki_filp = file;
-	fput(lower_file);
+	/* lower_file is pinned by file, see wrapfs_read_iter() */
+	if (!is_sync_kiocb(iocb)) {
+		err = wrapfs_aio_rw(iocb, iter, lower_file, WRITE);
+	} else {
+		iocb->ki_filp = lower_file;
+		err = lower_file->f_op->write_iter(iocb, iter);
+		iocb->ki_filp = file;
+	}
+	wrapfs_xattr_cache_clear(file_inode(file));
+	wrapfs_cache_invalidate(file_inode(file));
+	wrapfs_attr_changed(file_inode(file));
 	/* update upper inode times/sizes as needed */
-	if (err >= 0 || err == -EIOCBQUEUED) {
+	if ((err >= 0 || err == -EIOCBQUEUED) &&
+	    !wrapfs_test_opt(file->f_path.dentry->d_sb, ATTR_LAZY)) {
 		fsstack_copy_inode_size(d_inode(file->f_path.dentry),
 					file_inode(lower_file));
 		fsstack_copy_attr_times(d_inode(file->f_path.dentry),
 					file_inode(lower_file));
 	}
 out:
+	if (err > 0)
+		wrapfs_stat_add(sbinfo, WRAPFS_STAT_WRITE_BYTES, err);
 	return err;
 }
 
 const struct file_operations wrapfs_main_fops = {
-	.llseek		= generic_file_llseek,
+	.llseek		= wrapfs_llseek,
 	.read		= wrapfs_read,
 	.write		= wrapfs_write,
 	.unlocked_ioctl	= wrapfs_unlocked_ioctl,
@@ -467,6 +1059,9 @@ const struct file_operations wrapfs_main_fops = {
 	.release	= wrapfs_file_release,
 	.fsync		= wrapfs_fsync,
 	.fasync		= wrapfs_fasync,
+	.lock		= wrapfs_lock,
+	.flock		= wrapfs_flock,
+	.setlease	= wrapfs_setlease,
 	.read_iter	= wrapfs_read_iter,
 	.write_iter	= wrapfs_write_iter,
 };
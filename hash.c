@@ -41,6 +41,8 @@ int wrapfs_is_hidden(struct wrapfs_sb_info *sbinfo, const char *path,
 	if (!wh)
 		goto out;
 	hidden = wh->flags & WRAPFS_HIDE ? 1 : 0;
+	if (hidden)
+		wrapfs_stat_inc(sbinfo, WRAPFS_STAT_RULE_HIT);
 
 out:
 	spin_unlock(&sbinfo->hlock);
@@ -58,12 +60,36 @@ int wrapfs_is_blocked(struct wrapfs_sb_info *sbinfo, const char *path,
 	if (!wh)
 		goto out;
 	blocked = wh->flags & WRAPFS_BLOCK ? 1 : 0;
+	if (blocked)
+		wrapfs_stat_inc(sbinfo, WRAPFS_STAT_RULE_HIT);
 
 out:
 	spin_unlock(&sbinfo->hlock);
 	return blocked;
 }
 
+/*
+ * Like wrapfs_is_blocked(), for when only the inode number is known, as
+ * for a dentry decoded from a file handle, whose name may be "/".
+ */
+int wrapfs_ino_is_blocked(struct wrapfs_sb_info *sbinfo, unsigned long ino)
+{
+	struct wrapfs_hnode *wh;
+	int blocked = 0;
+	int i;
+
+	spin_lock(&sbinfo->hlock);
+	hash_for_each(sbinfo->hlist, i, wh, hnode) {
+		if (wh->inode == ino && (wh->flags & WRAPFS_BLOCK)) {
+			blocked = 1;
+			wrapfs_stat_inc(sbinfo, WRAPFS_STAT_RULE_HIT);
+			break;
+		}
+	}
+	spin_unlock(&sbinfo->hlock);
+	return blocked;
+}
+
 static struct wrapfs_hnode *alloc_hnode(const char *path, unsigned long ino)
 {
 	struct wrapfs_hnode *wh;
@@ -41,6 +41,7 @@ static int wrapfs_create(struct inode *dir, struct dentry *dentry,
 		goto out;
 	fsstack_copy_attr_times(dir, wrapfs_lower_inode(dir));
 	fsstack_copy_inode_size(dir, d_inode(lower_parent_dentry));
+	wrapfs_attr_changed(dir);
 
 out:
 	unlock_dir(lower_parent_dentry);
@@ -48,13 +49,160 @@ out:
 	return err;
 }
 
+/*
+ * Create and open in one step.  The create runs under the lower parent
+ * lock, so FILE_CREATED (and with it fsnotify events and audit records)
+ * reflects what the lower file system actually did, and the new lower
+ * file is opened without a second path walk.  If the name turns out to
+ * exist on the lower after all, the VFS opens it like any existing file,
+ * applying O_EXCL, permission checks and O_TRUNC itself.
+ *
+ * This saves the upper lookup/create/open sequence, not lower work: the
+ * lower still sees a create and an open.  The kernel exports no
+ * vfs-level atomic_open, and the lower's ->atomic_open can't be called
+ * directly as it needs a struct file that only path_openat() can
+ * allocate (get_empty_filp() is not exported).
+ */
+static int wrapfs_atomic_open(struct inode *dir, struct dentry *dentry,
+			      struct file *file, unsigned open_flag,
+			      umode_t create_mode, int *opened)
+{
+	int err = 0;
+	bool created = false;
+	struct dentry *res = NULL;
+	struct dentry *lower_dentry;
+	struct dentry *lower_parent_dentry;
+	struct file *lower_file;
+	struct path lower_path;
+	struct super_block *sb = dir->i_sb;
+
+	if (d_unhashed(dentry)) {
+		res = wrapfs_lookup(dir, dentry, 0);
+		if (IS_ERR(res))
+			return PTR_ERR(res);
+		if (res)
+			dentry = res;
+	}
+
+	/* plain lookup, or an existing file: let the VFS open it */
+	if (!(open_flag & O_CREAT) || d_really_is_positive(dentry))
+		return finish_no_open(file, res);
+
+	wrapfs_get_lower_path(dentry, &lower_path);
+	lower_dentry = lower_path.dentry;
+	lower_parent_dentry = lock_parent(lower_dentry);
+	if (d_really_is_negative(lower_dentry)) {
+		err = vfs_create(d_inode(lower_parent_dentry), lower_dentry,
+				 create_mode, open_flag & O_EXCL);
+		created = !err;
+	} else if (wrapfs_is_blocked(WRAPFS_SB(sb),
+				     lower_dentry->d_name.name,
+				     d_inode(lower_dentry)->i_ino)) {
+		err = -EPERM;
+	}
+	unlock_dir(lower_parent_dentry);
+	if (err)
+		goto out;
+
+	err = wrapfs_interpose(dentry, sb, &lower_path);
+	if (err)
+		goto out;
+	if (!created) {
+		/* created on the lower behind our back */
+		wrapfs_put_lower_path(dentry, &lower_path);
+		return finish_no_open(file, res);
+	}
+	fsstack_copy_attr_times(dir, wrapfs_lower_inode(dir));
+	fsstack_copy_inode_size(dir, wrapfs_lower_inode(dir));
+	wrapfs_attr_changed(dir);
+
+	lower_file = dentry_open(&lower_path, open_flag, file->f_cred);
+	if (IS_ERR(lower_file)) {
+		err = PTR_ERR(lower_file);
+		goto out;
+	}
+	*opened |= FILE_CREATED;
+	err = wrapfs_finish_open(file, dentry, lower_file, opened);
+
+out:
+	wrapfs_put_lower_path(dentry, &lower_path);
+	dput(res);
+	return err;
+}
+
+/*
+ * O_TMPFILE: let the lower file system create the anonymous inode on an
+ * unhashed lower dentry and wrap it.  Neither dentry is ever hashed.
+ * This kernel has no vfs_tmpfile(), so the checks it would make on the
+ * lower directory (write access to its mount, may_create()) are made
+ * here before calling the lower ->tmpfile.
+ */
+static int wrapfs_tmpfile(struct inode *dir, struct dentry *dentry,
+			  umode_t mode)
+{
+	int err;
+	struct inode *inode;
+	struct inode *lower_dir_inode = wrapfs_lower_inode(dir);
+	struct dentry *lower_dentry;
+	struct dentry *parent;
+	struct path lower_parent_path, lower_path;
+
+	if (!lower_dir_inode->i_op->tmpfile)
+		return -EOPNOTSUPP;
+
+	parent = dget_parent(dentry);
+	wrapfs_get_lower_path(parent, &lower_parent_path);
+
+	/* allocate dentry private data.  We free it in ->d_release */
+	err = new_dentry_private_data(dentry);
+	if (err)
+		goto out;
+
+	lower_dentry = d_alloc(lower_parent_path.dentry, &dentry->d_name);
+	if (!lower_dentry) {
+		err = -ENOMEM;
+		goto out;
+	}
+	lower_path.dentry = lower_dentry;
+	lower_path.mnt = mntget(lower_parent_path.mnt);
+	wrapfs_set_lower_path(dentry, &lower_path);
+
+	err = mnt_want_write(lower_parent_path.mnt);
+	if (err)
+		goto out;
+	if (IS_DEADDIR(lower_dir_inode))
+		err = -ENOENT;
+	else
+		err = inode_permission(lower_dir_inode, MAY_WRITE | MAY_EXEC);
+	if (!err)
+		err = lower_dir_inode->i_op->tmpfile(lower_dir_inode,
+						     lower_dentry, mode);
+	mnt_drop_write(lower_parent_path.mnt);
+	if (err)
+		goto out;
+
+	inode = wrapfs_iget(dir->i_sb, d_inode(lower_dentry));
+	if (IS_ERR(inode)) {
+		err = PTR_ERR(inode);
+		goto out;
+	}
+	d_instantiate(dentry, inode);
+
+out:
+	wrapfs_put_lower_path(parent, &lower_parent_path);
+	dput(parent);
+	return err;
+}
+
 static int wrapfs_link(struct dentry *old_dentry, struct inode *dir,
 		       struct dentry *new_dentry)
 {
 	struct dentry *lower_old_dentry;
 	struct dentry *lower_new_dentry;
 	struct dentry *lower_dir_dentry;
+	struct inode *lower_inode;
 	u64 file_size_save;
+	bool set_linkable = false;
 	int err;
 	struct path lower_old_path, lower_new_path;
 
@@ -65,8 +213,24 @@ static int wrapfs_link(struct dentry *old_dentry, struct inode *dir,
 	lower_new_dentry = lower_new_path.dentry;
 	lower_dir_dentry = lock_parent(lower_new_dentry);
 
+	/* linkat() of an O_TMPFILE file: the lower inode must allow it too */
+	lower_inode = d_inode(lower_old_dentry);
+	if ((d_inode(old_dentry)->i_state & I_LINKABLE) &&
+	    lower_inode->i_nlink == 0) {
+		spin_lock(&lower_inode->i_lock);
+		lower_inode->i_state |= I_LINKABLE;
+		spin_unlock(&lower_inode->i_lock);
+		set_linkable = true;
+	}
+
 	err = vfs_link(lower_old_dentry, d_inode(lower_dir_dentry),
 		       lower_new_dentry, NULL);
+	/* on success vfs_link() cleared it; otherwise don't leave it set */
+	if (err && set_linkable) {
+		spin_lock(&lower_inode->i_lock);
+		lower_inode->i_state &= ~I_LINKABLE;
+		spin_unlock(&lower_inode->i_lock);
+	}
 	if (err || !d_inode(lower_new_dentry))
 		goto out;
 
@@ -77,6 +241,8 @@ static int wrapfs_link(struct dentry *old_dentry, struct inode *dir,
 	fsstack_copy_inode_size(dir, d_inode(lower_new_dentry));
 	set_nlink(d_inode(old_dentry),
 		  wrapfs_lower_inode(d_inode(old_dentry))->i_nlink);
+	wrapfs_attr_changed(dir);
+	wrapfs_attr_changed(d_inode(old_dentry));
 	i_size_write(d_inode(new_dentry), file_size_save);
 out:
 	unlock_dir(lower_dir_dentry);
@@ -115,6 +281,8 @@ static int wrapfs_unlink(struct inode *dir, struct dentry *dentry)
 	fsstack_copy_attr_times(dir, lower_dir_inode);
 	fsstack_copy_inode_size(dir, lower_dir_inode);
 	set_nlink(d_inode(dentry), wrapfs_lower_inode(d_inode(dentry))->i_nlink);
+	wrapfs_attr_changed(dir);
+	wrapfs_attr_changed(d_inode(dentry));
 	d_inode(dentry)->i_ctime = dir->i_ctime;
 	d_drop(dentry); /* this is needed, else LTP fails (VFS won't do it) */
 	wrapfs_remove_hnode(WRAPFS_SB(sb), dentry->d_name.name,
@@ -146,6 +314,7 @@ static int wrapfs_symlink(struct inode *dir, struct dentry *dentry,
 		goto out;
 	fsstack_copy_attr_times(dir, wrapfs_lower_inode(dir));
 	fsstack_copy_inode_size(dir, d_inode(lower_parent_dentry));
+	wrapfs_attr_changed(dir);
 
 out:
 	unlock_dir(lower_parent_dentry);
@@ -174,6 +343,7 @@ static int wrapfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 
 	fsstack_copy_attr_times(dir, wrapfs_lower_inode(dir));
 	fsstack_copy_inode_size(dir, d_inode(lower_parent_dentry));
+	wrapfs_attr_changed(dir);
 	/* update number of links on parent directory */
 	set_nlink(dir, wrapfs_lower_inode(dir)->i_nlink);
 
@@ -204,6 +374,7 @@ static int wrapfs_rmdir(struct inode *dir, struct dentry *dentry)
 	fsstack_copy_attr_times(dir, d_inode(lower_dir_dentry));
 	fsstack_copy_inode_size(dir, d_inode(lower_dir_dentry));
 	set_nlink(dir, d_inode(lower_dir_dentry)->i_nlink);
+	wrapfs_attr_changed(dir);
 
 out:
 	unlock_dir(lower_dir_dentry);
@@ -232,6 +403,7 @@ static int wrapfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 		goto out;
 	fsstack_copy_attr_times(dir, wrapfs_lower_inode(dir));
 	fsstack_copy_inode_size(dir, d_inode(lower_parent_dentry));
+	wrapfs_attr_changed(dir);
 
 out:
 	unlock_dir(lower_parent_dentry);
@@ -287,6 +459,11 @@ static int wrapfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 		fsstack_copy_inode_size(old_dir,
 					d_inode(lower_old_dir_dentry));
 	}
+	wrapfs_attr_changed(old_dir);
+	wrapfs_attr_changed(new_dir);
+	wrapfs_attr_changed(d_inode(old_dentry));
+	if (d_inode(new_dentry))
+		wrapfs_attr_changed(d_inode(new_dentry));
 
 out:
 	unlock_rename(lower_old_dir_dentry, lower_new_dir_dentry);
@@ -297,37 +474,72 @@ out:
 	return err;
 }
 
-static int wrapfs_readlink(struct dentry *dentry, char __user *buf, int bufsiz)
+/*
+ * Symlink bodies never change, so the first lookup caches the body in
+ * i_link, which the VFS then follows directly, in RCU-walk too, without
+ * calling back into us or the lower file system.  The body is freed
+ * along with the inode.
+ */
+static const char *wrapfs_get_link(struct dentry *dentry,
+				   struct inode *inode,
+				   struct delayed_call *done)
 {
-	int err;
+	const char *link;
+	char *body;
 	struct dentry *lower_dentry;
+	struct inode *lower_inode;
 	struct path lower_path;
+	DEFINE_DELAYED_CALL(lower_done);
+
+	if (!dentry)
+		return ERR_PTR(-ECHILD);
 
 	wrapfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
-	if (!d_inode(lower_dentry)->i_op ||
-	    !d_inode(lower_dentry)->i_op->readlink) {
-		err = -EINVAL;
-		goto out;
+	lower_inode = d_inode(lower_dentry);
+	link = lower_inode->i_link;
+	if (!link) {
+		if (!lower_inode->i_op->get_link) {
+			link = ERR_PTR(-EINVAL);
+			goto out;
+		}
+		link = lower_inode->i_op->get_link(lower_dentry, lower_inode,
+						   &lower_done);
+		if (IS_ERR(link))
+			goto out;
 	}
 
-	err = d_inode(lower_dentry)->i_op->readlink(lower_dentry,
-						    buf, bufsiz);
-	if (err < 0)
+	body = kstrdup(link, GFP_KERNEL);
+	do_delayed_call(&lower_done);
+	if (!body) {
+		link = ERR_PTR(-ENOMEM);
 		goto out;
-	fsstack_copy_attr_atime(d_inode(dentry), d_inode(lower_dentry));
+	}
+	if (cmpxchg(&inode->i_link, NULL, body))
+		kfree(body);
+	link = inode->i_link;
+	fsstack_copy_attr_atime(inode, lower_inode);
 
 out:
 	wrapfs_put_lower_path(dentry, &lower_path);
-	return err;
+	return link;
 }
 
+/*
+ * May be called in RCU-walk (MAY_NOT_BLOCK), where the inode can be
+ * under eviction; inode_permission() passes MAY_NOT_BLOCK on to the
+ * lower file system.
+ */
 static int wrapfs_permission(struct inode *inode, int mask)
 {
 	struct inode *lower_inode;
 	int err;
 
-	lower_inode = wrapfs_lower_inode(inode);
+	lower_inode = READ_ONCE(WRAPFS_I(inode)->lower_inode);
+	if (!lower_inode)
+		return -ECHILD;
+	if (wrapfs_test_opt(inode->i_sb, ATTR_LAZY))
+		wrapfs_refresh_attrs(inode);
 	err = inode_permission(lower_inode, mask);
 	return err;
 }
@@ -342,6 +554,9 @@ static int wrapfs_setattr(struct dentry *dentry, struct iattr *ia)
 	struct iattr lower_ia;
 
 	inode = d_inode(dentry);
+	wrapfs_stat_inc(WRAPFS_SB(inode->i_sb), WRAPFS_STAT_SETATTR);
+	/* staged writes go before the new size and times */
+	wrapfs_stage_flush(inode);
 
 #if 0
 	/*
@@ -360,8 +575,14 @@ static int wrapfs_setattr(struct dentry *dentry, struct iattr *ia)
 
 	/* prepare our own lower struct iattr (with the lower file) */
 	memcpy(&lower_ia, ia, sizeof(lower_ia));
-	if (ia->ia_valid & ATTR_FILE)
-		lower_ia.ia_file = wrapfs_lower_file(ia->ia_file);
+	if (ia->ia_valid & ATTR_FILE) {
+		/* the lower open of a read-only file may be deferred */
+		lower_ia.ia_file = wrapfs_open_lower(ia->ia_file);
+		if (IS_ERR(lower_ia.ia_file)) {
+			err = PTR_ERR(lower_ia.ia_file);
+			goto out;
+		}
+	}
 
 	/*
 	 * If shrinking, first truncate upper level to cancel writing dirty
@@ -395,11 +616,16 @@ static int wrapfs_setattr(struct dentry *dentry, struct iattr *ia)
 	err = notify_change(lower_dentry, &lower_ia, /* note: lower_ia */
 			    NULL);
 	inode_unlock(d_inode(lower_dentry));
+	/* mode and owner changes may kill security.capability */
+	wrapfs_xattr_cache_clear(inode);
+	if (ia->ia_valid & ATTR_SIZE)
+		wrapfs_cache_invalidate(inode);
 	if (err)
 		goto out;
 
 	/* get attributes from the lower inode */
 	fsstack_copy_attr_all(inode, lower_inode);
+	wrapfs_attr_changed(inode);
 	/*
 	 * Not running fsstack_copy_inode_size(inode, lower_inode), because
 	 * VFS should update our inode size, and notify_change on
@@ -414,21 +640,242 @@ out_err:
 	return err;
 }
 
+/*
+ * security.* and user.* xattrs are probed constantly (LSMs, capability
+ * checks on every write, our own tooling), mostly for names that don't
+ * exist.  Small values and ENODATA results for those are cached per
+ * inode, most recently used first, until the lower ctime moves or
+ * wrapfs changes the inode itself: set/removexattr, setattr and writes,
+ * which may have the lower drop security.capability.  system.* ones are
+ * left alone entirely.
+ */
+#define WRAPFS_XATTR_CACHE_MAX	8	/* entries per inode */
+#define WRAPFS_XATTR_VALUE_MAX	256	/* larger values aren't cached */
+
+struct wrapfs_xattr {
+	struct list_head list;
+	ssize_t size;		/* value size, or -ENODATA */
+	char *value;
+	char name[];
+};
+
+static bool wrapfs_xattr_cacheable(const char *name)
+{
+	return !strncmp(name, XATTR_SECURITY_PREFIX,
+			XATTR_SECURITY_PREFIX_LEN) ||
+		!strncmp(name, XATTR_USER_PREFIX, XATTR_USER_PREFIX_LEN);
+}
+
+/* caller holds info->lock and frees @dispose after dropping it */
+static void __wrapfs_xattr_cache_detach(struct wrapfs_inode_info *info,
+					struct list_head *dispose)
+{
+	list_splice_init(&info->xattrs, dispose);
+	info->nr_xattrs = 0;
+	info->xattr_gen++;
+}
+
+static void wrapfs_xattr_free_list(struct list_head *head)
+{
+	struct wrapfs_xattr *xa, *tmp;
+
+	list_for_each_entry_safe(xa, tmp, head, list)
+		kfree(xa);
+}
+
+void wrapfs_xattr_cache_clear(struct inode *inode)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	LIST_HEAD(dispose);
+
+	spin_lock(&info->lock);
+	__wrapfs_xattr_cache_detach(info, &dispose);
+	spin_unlock(&info->lock);
+	wrapfs_xattr_free_list(&dispose);
+}
+
+/* returns true on a hit, with the getxattr result in @res */
+static bool wrapfs_xattr_cache_get(struct inode *inode, const char *name,
+				   void *buffer, size_t size, ssize_t *res,
+				   unsigned long *gen)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct wrapfs_xattr *xa;
+	bool found = false;
+
+	spin_lock(&info->lock);
+	*gen = info->xattr_gen;
+	list_for_each_entry(xa, &info->xattrs, list) {
+		if (strcmp(xa->name, name))
+			continue;
+		*res = xa->size;
+		if (xa->size > 0 && size) {
+			if (size < xa->size)
+				*res = -ERANGE;
+			else
+				memcpy(buffer, xa->value, xa->size);
+		}
+		list_move(&xa->list, &info->xattrs);
+		found = true;
+		break;
+	}
+	spin_unlock(&info->lock);
+
+	return found;
+}
+
+/*
+ * Add a getxattr result, unless the cache was dropped since @gen was
+ * sampled, i.e. the result may already be stale.
+ */
+static void wrapfs_xattr_cache_add(struct inode *inode, const char *name,
+				   const void *value, ssize_t size,
+				   unsigned long gen)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct wrapfs_xattr *xa, *victim = NULL;
+	size_t name_len = strlen(name) + 1;
+	size_t value_len = size > 0 ? size : 0;
+
+	xa = kmalloc(sizeof(*xa) + name_len + value_len, GFP_NOFS);
+	if (!xa)
+		return;
+	memcpy(xa->name, name, name_len);
+	xa->value = xa->name + name_len;
+	memcpy(xa->value, value, value_len);
+	xa->size = size;
+
+	spin_lock(&info->lock);
+	if (info->xattr_gen != gen) {
+		victim = xa;
+		goto out;
+	}
+	list_for_each_entry(victim, &info->xattrs, list) {
+		/* somebody else filled it in meanwhile */
+		if (!strcmp(victim->name, name)) {
+			victim = xa;
+			goto out;
+		}
+	}
+	victim = NULL;
+	list_add(&xa->list, &info->xattrs);
+	if (++info->nr_xattrs > WRAPFS_XATTR_CACHE_MAX) {
+		victim = list_last_entry(&info->xattrs, struct wrapfs_xattr,
+					 list);
+		list_del(&victim->list);
+		info->nr_xattrs--;
+	}
+out:
+	spin_unlock(&info->lock);
+	kfree(victim);
+}
+
+/*
+ * Cached xattrs stay valid until the lower inode's ctime moves, which
+ * any xattr or mode change on the lower does.  Called wherever lower
+ * attributes are looked at again.
+ */
+static void wrapfs_check_caches(struct inode *inode)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct inode *lower_inode = READ_ONCE(info->lower_inode);
+	LIST_HEAD(dispose);
+
+	if (!lower_inode)
+		return;
+
+	spin_lock(&info->lock);
+	if (!timespec_equal(&info->cache_ctime, &lower_inode->i_ctime)) {
+		info->cache_ctime = lower_inode->i_ctime;
+		__wrapfs_xattr_cache_detach(info, &dispose);
+	}
+	spin_unlock(&info->lock);
+
+	wrapfs_xattr_free_list(&dispose);
+}
+
+/*
+ * ACLs are not kept in the upper inode's ACL cache: a ctime check can't
+ * tell whether the lower's ACLs changed within one timestamp tick, and
+ * the lower already caches them itself, coherently with its own updates.
+ */
+static struct posix_acl *wrapfs_get_acl(struct inode *inode, int type)
+{
+	return get_acl(wrapfs_lower_inode(inode), type);
+}
+
+/*
+ * In attr_sync=lazy mode the data and lookup paths don't push lower
+ * attributes up after every operation; instead they are pulled here
+ * whenever the upper inode is observed.  A lower inode whose times,
+ * size and block count still match has nothing new to copy, which keeps
+ * the common case to a few loads.
+ */
+void wrapfs_refresh_attrs(struct inode *inode)
+{
+	struct inode *lower_inode = READ_ONCE(WRAPFS_I(inode)->lower_inode);
+
+	/* evicted under an RCU-walk caller */
+	if (!lower_inode)
+		return;
+	wrapfs_check_caches(inode);
+	if (timespec_equal(&inode->i_ctime, &lower_inode->i_ctime) &&
+	    timespec_equal(&inode->i_mtime, &lower_inode->i_mtime) &&
+	    i_size_read(inode) == i_size_read(lower_inode) &&
+	    inode->i_blocks == lower_inode->i_blocks)
+		return;
+
+	fsstack_copy_attr_all(inode, lower_inode);
+	fsstack_copy_inode_size(inode, lower_inode);
+}
+
+/*
+ * With attr_timeout= set, the attributes fetched here are served from
+ * the upper inode for that many seconds, or until wrapfs itself changes
+ * the inode (wrapfs_attr_changed()), saving a round trip per stat() on
+ * network and FUSE lowers.  Changes made directly on the lower show up
+ * after at most the timeout.
+ */
 static int wrapfs_getattr(struct vfsmount *mnt, struct dentry *dentry,
 			  struct kstat *stat)
 {
 	int err;
-	struct kstat lower_stat;
+	struct inode *inode = d_inode(dentry);
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	unsigned long timeout = WRAPFS_SB(dentry->d_sb)->attr_timeout;
+	unsigned long gen = 0;
 	struct path lower_path;
 
+	wrapfs_stat_inc(WRAPFS_SB(inode->i_sb), WRAPFS_STAT_GETATTR);
+	wrapfs_stage_flush(inode);
+	if (timeout) {
+		if (time_before(jiffies, READ_ONCE(info->attr_expire))) {
+			generic_fillattr(inode, stat);
+			return 0;
+		}
+		spin_lock(&info->lock);
+		gen = info->attr_gen;
+		spin_unlock(&info->lock);
+	}
+
 	wrapfs_get_lower_path(dentry, &lower_path);
-	err = vfs_getattr(&lower_path, &lower_stat);
+	/*
+	 * Hand back the lower's own answer rather than rebuilding it from
+	 * the upper inode; only the device is ours.  The upper inode is
+	 * brought up to date only if the lower one changed.
+	 */
+	err = vfs_getattr(&lower_path, stat);
 	if (err)
 		goto out;
-	fsstack_copy_attr_all(d_inode(dentry),
-			      d_inode(lower_path.dentry));
-	generic_fillattr(d_inode(dentry), stat);
-	stat->blocks = lower_stat.blocks;
+	stat->dev = inode->i_sb->s_dev;
+	wrapfs_refresh_attrs(inode);
+	/* unless wrapfs changed the inode while we were asking the lower */
+	if (timeout) {
+		spin_lock(&info->lock);
+		if (info->attr_gen == gen)
+			info->attr_expire = jiffies + timeout * HZ;
+		spin_unlock(&info->lock);
+	}
 out:
 	wrapfs_put_lower_path(dentry, &lower_path);
 	return err;
@@ -444,10 +891,12 @@ wrapfs_setxattr(struct dentry *dentry, const char *name, const void *value,
 	wrapfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	err = vfs_setxattr(lower_dentry, name, value, size, flags);
+	wrapfs_xattr_cache_clear(d_inode(dentry));
 	if (err)
 		goto out;
 	fsstack_copy_attr_all(d_inode(dentry),
 			      d_inode(lower_path.dentry));
+	wrapfs_attr_changed(d_inode(dentry));
 out:
 	wrapfs_put_lower_path(dentry, &lower_path);
 	return err;
@@ -457,16 +906,30 @@ static ssize_t
 wrapfs_getxattr(struct dentry *dentry, const char *name,
 		void *buffer, size_t size)
 {
-	int err;
+	ssize_t err;
 	struct dentry *lower_dentry;
 	struct inode *lower_inode;
+	struct inode *inode = d_inode(dentry);
 	struct path lower_path;
+	bool cache = wrapfs_xattr_cacheable(name);
+	unsigned long gen = 0;
+
+	if (cache) {
+		wrapfs_check_caches(inode);
+		if (wrapfs_xattr_cache_get(inode, name, buffer, size, &err,
+					   &gen))
+			return err;
+	}
 
 	wrapfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	lower_inode = d_inode(lower_dentry);
 	err = vfs_getxattr(lower_dentry, name, buffer, size);
-	if (err)
+	/* a size query brings no value along to cache */
+	if (cache && (err == -ENODATA ||
+		      (err >= 0 && size && err <= WRAPFS_XATTR_VALUE_MAX)))
+		wrapfs_xattr_cache_add(inode, name, buffer, err, gen);
+	if (err || wrapfs_test_opt(dentry->d_sb, ATTR_LAZY))
 		goto out;
 	fsstack_copy_attr_atime(d_inode(dentry),
 				d_inode(lower_path.dentry));
@@ -485,7 +948,7 @@ wrapfs_listxattr(struct dentry *dentry, char *buffer, size_t buffer_size)
 	wrapfs_get_lower_path(dentry, &lower_path);
 	lower_dentry = lower_path.dentry;
 	err = vfs_listxattr(lower_dentry, buffer, buffer_size);
-	if (err)
+	if (err || wrapfs_test_opt(dentry->d_sb, ATTR_LAZY))
 		goto out;
 	fsstack_copy_attr_atime(d_inode(dentry),
 				d_inode(lower_path.dentry));
@@ -506,24 +969,32 @@ wrapfs_removexattr(struct dentry *dentry, const char *name)
 	lower_dentry = lower_path.dentry;
 	lower_inode = d_inode(lower_dentry);;
 	err = vfs_removexattr(lower_dentry, name);
+	wrapfs_xattr_cache_clear(d_inode(dentry));
 	if (err)
 		goto out;
 	fsstack_copy_attr_all(d_inode(dentry), lower_inode);
+	wrapfs_attr_changed(d_inode(dentry));
 out:
 	wrapfs_put_lower_path(dentry, &lower_path);
 	return err;
 }
 
 const struct inode_operations wrapfs_symlink_iops = {
-	.readlink	= wrapfs_readlink,
+	.readlink	= generic_readlink,
+	.get_link	= wrapfs_get_link,
 	.permission	= wrapfs_permission,
 	.setattr	= wrapfs_setattr,
 	.getattr	= wrapfs_getattr,
+	.setxattr	= generic_setxattr,
+	.getxattr	= generic_getxattr,
 	.listxattr	= wrapfs_listxattr,
+	.removexattr	= generic_removexattr,
 };
 
 const struct inode_operations wrapfs_dir_iops = {
 	.create		= wrapfs_create,
+	.atomic_open	= wrapfs_atomic_open,
+	.tmpfile	= wrapfs_tmpfile,
 	.lookup		= wrapfs_lookup,
 	.link		= wrapfs_link,
 	.unlink		= wrapfs_unlink,
@@ -535,14 +1006,22 @@ const struct inode_operations wrapfs_dir_iops = {
 	.permission	= wrapfs_permission,
 	.setattr	= wrapfs_setattr,
 	.getattr	= wrapfs_getattr,
+	.setxattr	= generic_setxattr,
+	.getxattr	= generic_getxattr,
 	.listxattr	= wrapfs_listxattr,
+	.removexattr	= generic_removexattr,
+	.get_acl	= wrapfs_get_acl,
 };
 
 const struct inode_operations wrapfs_main_iops = {
 	.permission	= wrapfs_permission,
 	.setattr	= wrapfs_setattr,
 	.getattr	= wrapfs_getattr,
+	.setxattr	= generic_setxattr,
+	.getxattr	= generic_getxattr,
 	.listxattr	= wrapfs_listxattr,
+	.removexattr	= generic_removexattr,
+	.get_acl	= wrapfs_get_acl,
 };
 
 static int wrapfs_xattr_get(const struct xattr_handler *handler,
@@ -563,13 +1042,68 @@ static int wrapfs_xattr_set(const struct xattr_handler *handler,
 	return wrapfs_removexattr(dentry, name);
 }
 
+/*
+ * POSIX ACL xattrs are served from the lower's ACL cache rather than
+ * going to the lower's xattrs for every query.  Writes go to the lower as
+ * plain xattrs, which updates that cache.
+ */
+static int wrapfs_posix_acl_xattr_get(const struct xattr_handler *handler,
+				      struct dentry *dentry, const char *name,
+				      void *buffer, size_t size)
+{
+	struct inode *inode = d_inode(dentry);
+	struct posix_acl *acl;
+	int err;
+
+	if (!IS_POSIXACL(inode) || S_ISLNK(inode->i_mode))
+		return -EOPNOTSUPP;
+
+	acl = wrapfs_get_acl(inode, handler->flags);
+	if (IS_ERR(acl))
+		return PTR_ERR(acl);
+	if (!acl)
+		return -ENODATA;
+	err = posix_acl_to_xattr(&init_user_ns, acl, buffer, size);
+	posix_acl_release(acl);
+
+	return err;
+}
+
+static int wrapfs_posix_acl_xattr_set(const struct xattr_handler *handler,
+				      struct dentry *dentry, const char *name,
+				      const void *value, size_t size,
+				      int flags)
+{
+	if (value)
+		return wrapfs_setxattr(dentry, handler->name, value, size,
+				       flags);
+	return wrapfs_removexattr(dentry, handler->name);
+}
+
+static const struct xattr_handler wrapfs_posix_acl_access_xattr_handler = {
+	.name = XATTR_NAME_POSIX_ACL_ACCESS,
+	.flags = ACL_TYPE_ACCESS,
+	.get = wrapfs_posix_acl_xattr_get,
+	.set = wrapfs_posix_acl_xattr_set,
+};
+
+static const struct xattr_handler wrapfs_posix_acl_default_xattr_handler = {
+	.name = XATTR_NAME_POSIX_ACL_DEFAULT,
+	.flags = ACL_TYPE_DEFAULT,
+	.get = wrapfs_posix_acl_xattr_get,
+	.set = wrapfs_posix_acl_xattr_set,
+};
+
 const struct xattr_handler wrapfs_xattr_handler = {
 	.prefix = "",		/* match anything */
 	.get = wrapfs_xattr_get,
 	.set = wrapfs_xattr_set,
 };
 
+/* the catch-all handler has to come last */
 const struct xattr_handler *wrapfs_xattr_handlers[] = {
+	&wrapfs_posix_acl_access_xattr_handler,
+	&wrapfs_posix_acl_default_xattr_handler,
 	&wrapfs_xattr_handler,
 	NULL
 };
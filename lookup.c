@@ -27,16 +27,28 @@ int wrapfs_init_dentry_cache(void)
 
 void wrapfs_destroy_dentry_cache(void)
 {
-	if (wrapfs_dentry_cachep)
+	if (wrapfs_dentry_cachep) {
+		/* wait for pending wrapfs_free_dentry_info() calls */
+		rcu_barrier();
 		kmem_cache_destroy(wrapfs_dentry_cachep);
+	}
+}
+
+static void wrapfs_free_dentry_info(struct rcu_head *head)
+{
+	kmem_cache_free(wrapfs_dentry_cachep,
+			container_of(head, struct wrapfs_dentry_info, rcu));
 }
 
+/*
+ * RCU-walk ->d_revalidate may still be looking at it, so d_fsdata is left
+ * pointing at it; the RCU callback owns the memory from here on.
+ */
 void free_dentry_private_data(struct dentry *dentry)
 {
 	if (!dentry || !dentry->d_fsdata)
 		return;
-	kmem_cache_free(wrapfs_dentry_cachep, dentry->d_fsdata);
-	dentry->d_fsdata = NULL;
+	call_rcu(&WRAPFS_D(dentry)->rcu, wrapfs_free_dentry_info);
 }
 
 /* allocate new dentry private data */
@@ -215,9 +227,6 @@ static struct dentry *__wrapfs_lookup(struct dentry *dentry,
 	struct dentry *ret_dentry = NULL;
 	struct super_block *sb = dentry->d_sb;
 
-	/* must initialize dentry operations */
-	d_set_d_op(dentry, &wrapfs_dops);
-
 	if (IS_ROOT(dentry))
 		goto out;
 
@@ -289,6 +298,7 @@ struct dentry *wrapfs_lookup(struct inode *dir, struct dentry *dentry,
 	struct dentry *ret, *parent;
 	struct path lower_parent_path;
 
+	wrapfs_stat_inc(WRAPFS_SB(dir->i_sb), WRAPFS_STAT_LOOKUP);
 	parent = dget_parent(dentry);
 
 	wrapfs_get_lower_path(parent, &lower_parent_path);
@@ -304,6 +314,8 @@ struct dentry *wrapfs_lookup(struct inode *dir, struct dentry *dentry,
 		goto out;
 	if (ret)
 		dentry = ret;
+	if (wrapfs_test_opt(dir->i_sb, ATTR_LAZY))
+		goto out;
 	if (d_inode(dentry))
 		fsstack_copy_attr_times(d_inode(dentry),
 					wrapfs_lower_inode(d_inode(dentry)));
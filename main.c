@@ -22,7 +22,8 @@ static int wrapfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	int err = 0;
 	struct super_block *lower_sb;
 	struct path lower_path;
-	char *dev_name = (char *) raw_data;
+	struct wrapfs_mount_data *data = raw_data;
+	const char *dev_name = data->dev_name;
 	struct inode *inode;
 
 	if (!dev_name) {
@@ -49,18 +50,52 @@ static int wrapfs_read_super(struct super_block *sb, void *raw_data, int silent)
 		goto out_free;
 	}
 
+	err = wrapfs_stats_alloc(WRAPFS_SB(sb));
+	if (err)
+		goto out_freestats;
+	err = init_srcu_struct(&WRAPFS_SB(sb)->cache_srcu);
+	if (err)
+		goto out_freestats;
+
 	/* initialize internal hash list */
 	hash_init(WRAPFS_SB(sb)->hlist);
 	spin_lock_init(&WRAPFS_SB(sb)->hlock);
+	spin_lock_init(&WRAPFS_SB(sb)->statfs_lock);
+	INIT_WORK(&WRAPFS_SB(sb)->statfs_work, wrapfs_statfs_work);
+	spin_lock_init(&WRAPFS_SB(sb)->prefetch_lock);
+	INIT_LIST_HEAD(&WRAPFS_SB(sb)->prefetch_dirs);
+	init_waitqueue_head(&WRAPFS_SB(sb)->prefetch_wait);
+	spin_lock_init(&WRAPFS_SB(sb)->cache_lock);
+	INIT_LIST_HEAD(&WRAPFS_SB(sb)->cache_lru);
+	INIT_LIST_HEAD(&WRAPFS_SB(sb)->cache_fills);
+	INIT_WORK(&WRAPFS_SB(sb)->cache_work, wrapfs_cache_work);
+
+	err = wrapfs_parse_options(sb, data->raw_data);
+	if (err)
+		goto out_freesbi;
 
 	/* set the lower superblock field of upper superblock */
 	lower_sb = lower_path.dentry->d_sb;
 	atomic_inc(&lower_sb->s_active);
 	wrapfs_set_lower_super(sb, lower_sb);
 
+	/* ACLs are the lower's: let it apply umask and default ACLs */
+	sb->s_flags |= lower_sb->s_flags & MS_POSIXACL;
+
 	/* inherit maxbytes from lower file system */
 	sb->s_maxbytes = lower_sb->s_maxbytes;
 
+	/*
+	 * A bdi of our own, for the readahead window that posix_fadvise()
+	 * and friends adjust on upper files; see wrapfs_read_lower().
+	 */
+	err = bdi_setup_and_register(&WRAPFS_SB(sb)->bdi, "wrapfs");
+	if (err)
+		goto out_sput;
+	WRAPFS_SB(sb)->bdi.capabilities = BDI_CAP_NO_ACCT_AND_WRITEBACK;
+	sb->s_bdi = &WRAPFS_SB(sb)->bdi;
+	wrapfs_set_readahead(sb);
+
 	/*
 	 * Our c/m/atime granularity is 1 ns because we may stack on file
 	 * systems whose granularity is as good.
@@ -71,19 +106,20 @@ static int wrapfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	sb->s_xattr = wrapfs_xattr_handlers;
 
 	sb->s_export_op = &wrapfs_export_ops; /* adding NFS support */
+	/* also covers the anonymous dentries made by NFS handle decoding */
+	sb->s_d_op = &wrapfs_dops;
 
 	/* get a new inode and allocate our root dentry */
 	inode = wrapfs_iget(sb, d_inode(lower_path.dentry));
 	if (IS_ERR(inode)) {
 		err = PTR_ERR(inode);
-		goto out_sput;
+		goto out_bdi;
 	}
 	sb->s_root = d_make_root(inode);
 	if (!sb->s_root) {
 		err = -ENOMEM;
 		goto out_iput;
 	}
-	d_set_d_op(sb->s_root, &wrapfs_dops);
 
 	/* link the upper and lower dentries */
 	sb->s_root->d_fsdata = NULL;
@@ -95,6 +131,9 @@ static int wrapfs_read_super(struct super_block *sb, void *raw_data, int silent)
 
 	/* set the lower dentries for s_root */
 	wrapfs_set_lower_path(sb->s_root, &lower_path);
+	/* the statfs refresh work may outlive s_root on umount */
+	WRAPFS_SB(sb)->statfs_root = lower_path;
+	path_get(&WRAPFS_SB(sb)->statfs_root);
 
 	/*
 	 * No need to call interpose because we already have a positive
@@ -102,6 +141,7 @@ static int wrapfs_read_super(struct super_block *sb, void *raw_data, int silent)
 	 * d_rehash it.
 	 */
 	d_rehash(sb->s_root);
+	wrapfs_stats_register(sb);
 	if (!silent)
 		printk(KERN_INFO
 		       "wrapfs: mounted on top of %s type %s\n",
@@ -113,9 +153,17 @@ out_freeroot:
 	dput(sb->s_root);
 out_iput:
 	iput(inode);
+out_bdi:
+	sb->s_bdi = &noop_backing_dev_info;
+	bdi_destroy(&WRAPFS_SB(sb)->bdi);
 out_sput:
 	/* drop refs we took earlier */
 	atomic_dec(&lower_sb->s_active);
+out_freesbi:
+	wrapfs_cache_fini(WRAPFS_SB(sb));
+	cleanup_srcu_struct(&WRAPFS_SB(sb)->cache_srcu);
+out_freestats:
+	wrapfs_stats_put(WRAPFS_SB(sb));
 	kfree(WRAPFS_SB(sb));
 	sb->s_fs_info = NULL;
 out_free:
@@ -128,17 +176,27 @@ out:
 struct dentry *wrapfs_mount(struct file_system_type *fs_type, int flags,
 			    const char *dev_name, void *raw_data)
 {
-	void *lower_path_name = (void *) dev_name;
+	struct wrapfs_mount_data data = {
+		.dev_name = dev_name,
+		.raw_data = raw_data,
+	};
 
-	return mount_nodev(fs_type, flags, lower_path_name,
-			   wrapfs_read_super);
+	return mount_nodev(fs_type, flags, &data, wrapfs_read_super);
+}
+
+static void wrapfs_kill_sb(struct super_block *sb)
+{
+	/* readdir prefetch work holds lower path references */
+	if (WRAPFS_SB(sb))
+		wrapfs_prefetch_wait(WRAPFS_SB(sb));
+	generic_shutdown_super(sb);
 }
 
 static struct file_system_type wrapfs_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= WRAPFS_NAME,
 	.mount		= wrapfs_mount,
-	.kill_sb	= generic_shutdown_super,
+	.kill_sb	= wrapfs_kill_sb,
 	.fs_flags	= 0,
 };
 MODULE_ALIAS_FS(WRAPFS_NAME);
@@ -155,6 +213,13 @@ static int __init init_wrapfs_fs(void)
 	err = wrapfs_init_dentry_cache();
 	if (err)
 		goto out;
+	err = wrapfs_init_aio_cache();
+	if (err)
+		goto out;
+	err = wrapfs_init_prefetch();
+	if (err)
+		goto out;
+	wrapfs_init_stats();
 	err = register_filesystem(&wrapfs_fs_type);
 	if (err)
 		goto out;
@@ -163,6 +228,9 @@ static int __init init_wrapfs_fs(void)
 out:
 	wrapfs_destroy_inode_cache();
 	wrapfs_destroy_dentry_cache();
+	wrapfs_destroy_aio_cache();
+	wrapfs_destroy_prefetch();
+	wrapfs_destroy_stats();
 	return err;
 }
 
@@ -170,6 +238,9 @@ static void __exit exit_wrapfs_fs(void)
 {
 	wrapfs_destroy_inode_cache();
 	wrapfs_destroy_dentry_cache();
+	wrapfs_destroy_aio_cache();
+	wrapfs_destroy_prefetch();
+	wrapfs_destroy_stats();
 	unregister_filesystem(&wrapfs_fs_type);
 	pr_info("Completed wrapfs module unload\n");
 }
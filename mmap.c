@@ -11,64 +11,135 @@
 
 #include "wrapfs.h"
 
+/*
+ * ->fault, ->map_pages and ->page_mkwrite take no file argument, and
+ * lower implementations such as filemap_fault() find their file through
+ * vma->vm_file, which has to stay the upper file for concurrent faults.
+ * So each interposed vma carries a lower twin in vm_private_data: a
+ * copy made at mmap time whose vm_file is the lower file, handed to the
+ * lower vm_ops in its place.  Faults only bring over what mprotect,
+ * madvise, mremap or a split changed in the upper vma since.  Those
+ * hold mmap_sem for writing, so racing faults store the same values.
+ */
+static struct vm_area_struct *wrapfs_new_lower_vma(struct vm_area_struct *vma,
+						   struct vm_area_struct *from)
+{
+	struct vm_area_struct *lower_vma;
+
+	lower_vma = kmalloc(sizeof(*lower_vma), GFP_KERNEL);
+	if (!lower_vma)
+		return NULL;
+	memcpy(lower_vma, vma, sizeof(*lower_vma));
+	lower_vma->vm_file = from->vm_file;
+	lower_vma->vm_ops = from->vm_ops;
+	lower_vma->vm_private_data = from->vm_private_data;
+	return lower_vma;
+}
+
+/* called from wrapfs_mmap() once the lower ->mmap has run on @vma */
+int wrapfs_init_lower_vma(struct vm_area_struct *vma, struct file *lower_file)
+{
+	struct vm_area_struct from = {
+		.vm_file = lower_file,
+		.vm_ops = WRAPFS_F(vma->vm_file)->lower_vm_ops,
+		.vm_private_data = vma->vm_private_data,
+	};
+
+	vma->vm_private_data = wrapfs_new_lower_vma(vma, &from);
+	return vma->vm_private_data ? 0 : -ENOMEM;
+}
+
+/*
+ * Fork and split copy the upper vma; give the copy a twin of its own.
+ * There is no failing here, so without memory the new vma goes without
+ * one and wrapfs_lower_vma() falls back to a copy per fault.
+ */
+static void wrapfs_vm_open(struct vm_area_struct *vma)
+{
+	struct vm_area_struct *from = vma->vm_private_data;
+
+	vma->vm_private_data = from ? wrapfs_new_lower_vma(vma, from) : NULL;
+}
+
+static void wrapfs_vm_close(struct vm_area_struct *vma)
+{
+	kfree(vma->vm_private_data);
+}
+
+static struct vm_area_struct *wrapfs_lower_vma(struct vm_area_struct *vma,
+					       struct vm_area_struct *tmp)
+{
+	struct vm_area_struct *lower_vma = vma->vm_private_data;
+
+	if (unlikely(!lower_vma)) {
+		memcpy(tmp, vma, sizeof(*tmp));
+		tmp->vm_file = wrapfs_lower_file(vma->vm_file);
+		tmp->vm_ops = WRAPFS_F(vma->vm_file)->lower_vm_ops;
+		tmp->vm_private_data = NULL;
+		return tmp;
+	}
+
+	if (unlikely(lower_vma->vm_start != vma->vm_start ||
+		     lower_vma->vm_end != vma->vm_end ||
+		     lower_vma->vm_pgoff != vma->vm_pgoff ||
+		     lower_vma->vm_flags != vma->vm_flags ||
+		     pgprot_val(lower_vma->vm_page_prot) !=
+		     pgprot_val(vma->vm_page_prot))) {
+		lower_vma->vm_start = vma->vm_start;
+		lower_vma->vm_end = vma->vm_end;
+		lower_vma->vm_pgoff = vma->vm_pgoff;
+		lower_vma->vm_flags = vma->vm_flags;
+		lower_vma->vm_page_prot = vma->vm_page_prot;
+	}
+	return lower_vma;
+}
+
 static int wrapfs_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
-	int err;
-	struct file *file, *lower_file;
 	const struct vm_operations_struct *lower_vm_ops;
-	struct vm_area_struct lower_vma;
+	struct vm_area_struct tmp;
 
-	memcpy(&lower_vma, vma, sizeof(struct vm_area_struct));
-	file = lower_vma.vm_file;
-	lower_vm_ops = WRAPFS_F(file)->lower_vm_ops;
+	lower_vm_ops = WRAPFS_F(vma->vm_file)->lower_vm_ops;
 	BUG_ON(!lower_vm_ops);
+	return lower_vm_ops->fault(wrapfs_lower_vma(vma, &tmp), vmf);
+}
 
-	lower_file = wrapfs_lower_file(file);
-	/*
-	 * XXX: vm_ops->fault may be called in parallel.  Because we have to
-	 * resort to temporarily changing the vma->vm_file to point to the
-	 * lower file, a concurrent invocation of wrapfs_fault could see a
-	 * different value.  In this workaround, we keep a different copy of
-	 * the vma structure in our stack, so we never expose a different
-	 * value of the vma->vm_file called to us, even temporarily.  A
-	 * better fix would be to change the calling semantics of ->fault to
-	 * take an explicit file pointer.
-	 */
-	lower_vma.vm_file = lower_file;
-	err = lower_vm_ops->fault(&lower_vma, vmf);
-	return err;
+/*
+ * Fault-around: map the pages surrounding a read fault that are already
+ * in the lower page cache, so that a sequential scan of a mapping takes
+ * one fault per fault_around_bytes instead of one per page.
+ */
+static void wrapfs_map_pages(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	const struct vm_operations_struct *lower_vm_ops;
+	struct vm_area_struct tmp;
+
+	lower_vm_ops = WRAPFS_F(vma->vm_file)->lower_vm_ops;
+	BUG_ON(!lower_vm_ops);
+	/* nothing mapped here: the core falls back to ->fault */
+	if (!lower_vm_ops->map_pages)
+		return;
+	lower_vm_ops->map_pages(wrapfs_lower_vma(vma, &tmp), vmf);
 }
 
 static int wrapfs_page_mkwrite(struct vm_area_struct *vma,
 			       struct vm_fault *vmf)
 {
 	int err = 0;
-	struct file *file, *lower_file;
+	struct file *file = vma->vm_file;
 	const struct vm_operations_struct *lower_vm_ops;
-	struct vm_area_struct lower_vma;
+	struct vm_area_struct tmp;
 
-	memcpy(&lower_vma, vma, sizeof(struct vm_area_struct));
-	file = lower_vma.vm_file;
 	lower_vm_ops = WRAPFS_F(file)->lower_vm_ops;
 	BUG_ON(!lower_vm_ops);
 	if (!lower_vm_ops->page_mkwrite)
 		goto out;
 
-	lower_file = wrapfs_lower_file(file);
-	/*
-	 * XXX: vm_ops->page_mkwrite may be called in parallel.
-	 * Because we have to resort to temporarily changing the
-	 * vma->vm_file to point to the lower file, a concurrent
-	 * invocation of wrapfs_page_mkwrite could see a different
-	 * value.  In this workaround, we keep a different copy of the
-	 * vma structure in our stack, so we never expose a different
-	 * value of the vma->vm_file called to us, even temporarily.
-	 * A better fix would be to change the calling semantics of
-	 * ->page_mkwrite to take an explicit file pointer.
-	 */
-	lower_vma.vm_file = lower_file;
-	err = lower_vm_ops->page_mkwrite(&lower_vma, vmf);
+	err = lower_vm_ops->page_mkwrite(wrapfs_lower_vma(vma, &tmp), vmf);
+	wrapfs_attr_changed(file_inode(file));
 out:
+	wrapfs_xattr_cache_clear(file_inode(file));
+	wrapfs_cache_invalidate(file_inode(file));
 	return err;
 }
 
@@ -83,11 +154,56 @@ static ssize_t wrapfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter,
 	return -EINVAL;
 }
 
+/*
+ * wrapfs reads through the lower page cache, so the upper mapping is
+ * only read ahead into by readahead(2) and POSIX_FADV_WILLNEED (and
+ * MADV_WILLNEED on interposed mappings).  Forward those to the lower
+ * file, with a readahead state of our own so that the whole range is
+ * read and the file's sequential detection is left alone.  The upper
+ * pages are never added to the upper mapping; the caller frees them.
+ * The range is cut at the lower's size, which the upper one may lag.
+ */
+static int wrapfs_readpages(struct file *file, struct address_space *mapping,
+			    struct list_head *pages, unsigned nr_pages)
+{
+	struct file *lower_file;
+	struct file_ra_state ra;
+	pgoff_t start = ULONG_MAX, end = 0;
+	struct page *page;
+	loff_t isize;
+
+	if (!file)
+		return 0;
+	list_for_each_entry(page, pages, lru) {
+		start = min(start, page->index);
+		end = max(end, page->index);
+	}
+	if (start > end)
+		return 0;
+
+	lower_file = wrapfs_open_lower(file);
+	if (IS_ERR(lower_file))
+		return PTR_ERR(lower_file);
+	isize = i_size_read(file_inode(lower_file));
+	if (!isize || start > ((isize - 1) >> PAGE_SHIFT))
+		return 0;
+	end = min_t(pgoff_t, end, (isize - 1) >> PAGE_SHIFT);
+	file_ra_state_init(&ra, lower_file->f_mapping);
+	ra.ra_pages = end - start + 1;
+	page_cache_sync_readahead(lower_file->f_mapping, &ra, lower_file,
+				  start, ra.ra_pages);
+	return 0;
+}
+
 const struct address_space_operations wrapfs_aops = {
+	.readpages = wrapfs_readpages,
 	.direct_IO = wrapfs_direct_IO,
 };
 
 const struct vm_operations_struct wrapfs_vm_ops = {
+	.open		= wrapfs_vm_open,
+	.close		= wrapfs_vm_close,
 	.fault		= wrapfs_fault,
+	.map_pages	= wrapfs_map_pages,
 	.page_mkwrite	= wrapfs_page_mkwrite,
 };
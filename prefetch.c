@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "wrapfs.h"
+
+/*
+ * readdir_prefetch=N: getdents() is usually followed by a lookup and a
+ * stat() of every entry, one lower round trip at a time.  Each readdir
+ * call queues the entries it handed out, as one batch per directory,
+ * for a lookup + getattr on the lower file system in the background, so
+ * that the lower's dentries and attribute caches are warm by the time
+ * the stat storm arrives.  Up to N workers per mount drain the queue,
+ * taking one name at a time from each directory in turn.  Nothing is
+ * instantiated on our side and none of our locks are taken.  Names are
+ * dropped only past WRAPFS_PREFETCH_QUEUE_MAX queued per mount, or when
+ * memory is short: prefetching is best effort.
+ */
+
+#define WRAPFS_PREFETCH_QUEUE_MAX	4096
+
+static struct workqueue_struct *wrapfs_prefetch_wq;
+
+/* the names of one readdir call */
+struct wrapfs_prefetch_dir {
+	struct list_head list;		/* on prefetch_dirs */
+	struct list_head names;		/* not started yet */
+	unsigned int nr;		/* not done yet */
+	struct path lower_parent;
+	const struct cred *cred;	/* of the reader, for permissions */
+};
+
+struct wrapfs_prefetch_name {
+	struct list_head list;
+	int len;
+	char name[];
+};
+
+struct wrapfs_prefetch_worker {
+	struct work_struct work;
+	struct list_head list;		/* until started */
+	struct wrapfs_sb_info *sbinfo;
+};
+
+static void wrapfs_prefetch_free_dir(struct wrapfs_prefetch_dir *pd)
+{
+	struct wrapfs_prefetch_name *pn, *tmp;
+
+	list_for_each_entry_safe(pn, tmp, &pd->names, list)
+		kfree(pn);
+	put_cred(pd->cred);
+	path_put(&pd->lower_parent);
+	kfree(pd);
+}
+
+static void wrapfs_prefetch_one(struct wrapfs_prefetch_dir *pd,
+				struct wrapfs_prefetch_name *pn)
+{
+	const struct cred *old_cred;
+	struct path lower_path;
+	struct kstat stat;
+
+	old_cred = override_creds(pd->cred);
+	lower_path.mnt = pd->lower_parent.mnt;
+	lower_path.dentry = lookup_one_len_unlocked(pn->name,
+						    pd->lower_parent.dentry,
+						    pn->len);
+	if (!IS_ERR(lower_path.dentry)) {
+		if (d_really_is_positive(lower_path.dentry))
+			vfs_getattr(&lower_path, &stat);
+		dput(lower_path.dentry);
+	}
+	revert_creds(old_cred);
+}
+
+/* drain the queue, round robin over the directories in it */
+static void wrapfs_prefetch_work(struct work_struct *work)
+{
+	struct wrapfs_prefetch_worker *worker =
+		container_of(work, struct wrapfs_prefetch_worker, work);
+	struct wrapfs_sb_info *sbinfo = worker->sbinfo;
+	struct wrapfs_prefetch_dir *pd;
+	struct wrapfs_prefetch_name *pn;
+
+	kfree(worker);
+
+	spin_lock(&sbinfo->prefetch_lock);
+	while (!list_empty(&sbinfo->prefetch_dirs)) {
+		pd = list_first_entry(&sbinfo->prefetch_dirs,
+				      struct wrapfs_prefetch_dir, list);
+		pn = list_first_entry(&pd->names,
+				      struct wrapfs_prefetch_name, list);
+		list_del(&pn->list);
+		if (list_empty(&pd->names))
+			list_del_init(&pd->list);
+		else
+			list_move_tail(&pd->list, &sbinfo->prefetch_dirs);
+		sbinfo->prefetch_queued--;
+		spin_unlock(&sbinfo->prefetch_lock);
+
+		wrapfs_prefetch_one(pd, pn);
+		kfree(pn);
+
+		spin_lock(&sbinfo->prefetch_lock);
+		if (!--pd->nr) {
+			spin_unlock(&sbinfo->prefetch_lock);
+			wrapfs_prefetch_free_dir(pd);
+			spin_lock(&sbinfo->prefetch_lock);
+		}
+	}
+	/* under the lock, see wrapfs_prefetch_wait() */
+	if (!--sbinfo->prefetch_workers)
+		wake_up(&sbinfo->prefetch_wait);
+	spin_unlock(&sbinfo->prefetch_lock);
+}
+
+/*
+ * Called from readdir for each entry it emitted; collects the names in
+ * @pdp, which wrapfs_prefetch_submit() queues once readdir is done.
+ */
+void wrapfs_prefetch(struct file *file, struct wrapfs_prefetch_dir **pdp,
+		     const char *name, int len)
+{
+	struct wrapfs_prefetch_dir *pd = *pdp;
+	struct wrapfs_prefetch_name *pn;
+
+	if (name[0] == '.' &&
+	    (len == 1 || (len == 2 && name[1] == '.')))
+		return;
+
+	/* readdir holds the directory lock: don't wait for memory */
+	if (!pd) {
+		pd = kmalloc(sizeof(*pd), GFP_NOWAIT | __GFP_NOWARN);
+		if (!pd)
+			return;
+		INIT_LIST_HEAD(&pd->list);
+		INIT_LIST_HEAD(&pd->names);
+		pd->nr = 0;
+		pd->lower_parent = wrapfs_lower_file(file)->f_path;
+		path_get(&pd->lower_parent);
+		pd->cred = get_cred(file->f_cred);
+		*pdp = pd;
+	}
+	if (pd->nr >= WRAPFS_PREFETCH_QUEUE_MAX)
+		return;
+
+	pn = kmalloc(sizeof(*pn) + len + 1, GFP_NOWAIT | __GFP_NOWARN);
+	if (!pn)
+		return;
+	memcpy(pn->name, name, len);
+	pn->name[len] = '\0';
+	pn->len = len;
+	list_add_tail(&pn->list, &pd->names);
+	pd->nr++;
+}
+
+/* queue the names collected by wrapfs_prefetch(), start workers for them */
+void wrapfs_prefetch_submit(struct file *file, struct wrapfs_prefetch_dir *pd)
+{
+	struct wrapfs_sb_info *sbinfo = WRAPFS_SB(file_inode(file)->i_sb);
+	struct wrapfs_prefetch_worker *worker, *tmp;
+	LIST_HEAD(workers);
+	unsigned int want;
+
+	/* can't allocate under the spinlock; spares are freed below */
+	want = min(pd->nr, READ_ONCE(sbinfo->readdir_prefetch));
+	while (want--) {
+		worker = kmalloc(sizeof(*worker), GFP_NOWAIT | __GFP_NOWARN);
+		if (!worker)
+			break;
+		INIT_WORK(&worker->work, wrapfs_prefetch_work);
+		worker->sbinfo = sbinfo;
+		list_add(&worker->list, &workers);
+	}
+
+	spin_lock(&sbinfo->prefetch_lock);
+	if (!pd->nr ||
+	    sbinfo->prefetch_queued + pd->nr > WRAPFS_PREFETCH_QUEUE_MAX)
+		goto out_drop;
+	list_add_tail(&pd->list, &sbinfo->prefetch_dirs);
+	sbinfo->prefetch_queued += pd->nr;
+	list_for_each_entry_safe(worker, tmp, &workers, list) {
+		if (sbinfo->prefetch_workers >= sbinfo->readdir_prefetch)
+			break;
+		list_del(&worker->list);
+		sbinfo->prefetch_workers++;
+		queue_work(wrapfs_prefetch_wq, &worker->work);
+	}
+	if (sbinfo->prefetch_workers) {
+		spin_unlock(&sbinfo->prefetch_lock);
+		goto out;
+	}
+	/* nobody to drain it */
+	list_del(&pd->list);
+	sbinfo->prefetch_queued -= pd->nr;
+out_drop:
+	spin_unlock(&sbinfo->prefetch_lock);
+	wrapfs_prefetch_free_dir(pd);
+out:
+	list_for_each_entry_safe(worker, tmp, &workers, list)
+		kfree(worker);
+}
+
+/*
+ * Prefetch work pins lower paths and uses @sbinfo, so it must be done
+ * before umount goes on.  Workers drain the whole queue before they
+ * exit, and the last one wakes us under prefetch_lock, so once we've
+ * seen zero and taken the lock it is done with @sbinfo.
+ */
+void wrapfs_prefetch_wait(struct wrapfs_sb_info *sbinfo)
+{
+	wait_event(sbinfo->prefetch_wait,
+		   !READ_ONCE(sbinfo->prefetch_workers));
+	spin_lock(&sbinfo->prefetch_lock);
+	spin_unlock(&sbinfo->prefetch_lock);
+}
+
+int wrapfs_init_prefetch(void)
+{
+	wrapfs_prefetch_wq = alloc_workqueue("wrapfs_prefetch",
+					     WQ_UNBOUND, 0);
+
+	return wrapfs_prefetch_wq ? 0 : -ENOMEM;
+}
+
+void wrapfs_destroy_prefetch(void)
+{
+	if (wrapfs_prefetch_wq)
+		destroy_workqueue(wrapfs_prefetch_wq);
+}
@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "wrapfs.h"
+
+/*
+ * Write staging (write_staging=<KiB>).
+ *
+ * Small synchronous writes to a regular file are appended to a buffer
+ * of the open file instead of each going to its lower file, and reach it
+ * as one write when the buffer is full, when a write doesn't follow on
+ * from the staged data, or WRAPFS_STAGE_DELAY after staging started.
+ * Anything that must see the data (reads, mmap, stat, truncate, seeks
+ * from the end, writes that aren't staged, writes through other open
+ * files of the inode, sync and freeze) writes the buffers of the inode
+ * or super block out first.  fsync() and close() do too, and also report
+ * the errors of earlier background flushes, the way they report
+ * writeback errors.  Files that are mmapped anywhere are not staged, as
+ * the mappings would not see the data.
+ *
+ * Buffers are WRAPFS_STAGE_SIZE bytes, allocated on the first staged
+ * write through an open file and kept until it is closed.  write_staging=
+ * bounds their total per mount; writes that find no room go straight to
+ * the lower file.
+ */
+
+#define WRAPFS_STAGE_SIZE	(64 * 1024)
+#define WRAPFS_STAGE_WRITE_MAX	(WRAPFS_STAGE_SIZE / 4)	/* "small" */
+#define WRAPFS_STAGE_DELAY	HZ
+
+struct wrapfs_stage {
+	struct mutex mutex;		/* protects all below */
+	struct list_head list;		/* on the inode's stages */
+	struct file *file;		/* upper file staged for */
+	char *buf;
+	loff_t pos;			/* file offset of buf[0] */
+	size_t len;
+	int err;			/* of a flush, for fsync()/close() */
+	struct delayed_work work;
+};
+
+/* write out the buffer; caller holds stage->mutex */
+static void __wrapfs_stage_flush(struct wrapfs_stage *stage)
+{
+	struct inode *inode = file_inode(stage->file);
+	struct file *lower_file = wrapfs_lower_file(stage->file);
+	const struct cred *old_cred;
+	ssize_t bytes = 0;
+	size_t done = 0;
+
+	if (!stage->len)
+		return;
+
+	/* the background flush would otherwise write as a kernel thread */
+	old_cred = override_creds(lower_file->f_cred);
+	file_start_write(lower_file);
+	while (done < stage->len) {
+		bytes = kernel_write(lower_file, stage->buf + done,
+				     stage->len - done, stage->pos + done);
+		if (bytes <= 0)
+			break;
+		done += bytes;
+	}
+	file_end_write(lower_file);
+	revert_creds(old_cred);
+
+	/* like failed writeback, what didn't make it is lost */
+	if (done < stage->len && !stage->err)
+		stage->err = bytes < 0 ? bytes : -EIO;
+
+	wrapfs_xattr_cache_clear(inode);
+	wrapfs_cache_invalidate(inode);
+	wrapfs_attr_changed(inode);
+	if (!wrapfs_test_opt(inode->i_sb, ATTR_LAZY)) {
+		fsstack_copy_inode_size(inode, file_inode(lower_file));
+		fsstack_copy_attr_times(inode, file_inode(lower_file));
+	}
+
+	stage->len = 0;
+	atomic_dec(&WRAPFS_I(inode)->nr_staged);
+}
+
+static void wrapfs_stage_work(struct work_struct *work)
+{
+	struct wrapfs_stage *stage =
+		container_of(to_delayed_work(work), struct wrapfs_stage, work);
+
+	mutex_lock(&stage->mutex);
+	__wrapfs_stage_flush(stage);
+	mutex_unlock(&stage->mutex);
+}
+
+static struct wrapfs_stage *wrapfs_get_stage(struct file *file)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(file_inode(file));
+	struct wrapfs_stage *stage;
+
+	stage = smp_load_acquire(&WRAPFS_F(file)->stage);
+	if (stage)
+		return stage;
+
+	mutex_lock(&info->stage_mutex);
+	stage = WRAPFS_F(file)->stage;
+	if (stage)
+		goto out;
+	stage = kzalloc(sizeof(*stage), GFP_KERNEL);
+	if (!stage)
+		goto out;
+	mutex_init(&stage->mutex);
+	stage->file = file;
+	INIT_DELAYED_WORK(&stage->work, wrapfs_stage_work);
+	list_add(&stage->list, &info->stages);
+	smp_store_release(&WRAPFS_F(file)->stage, stage);
+out:
+	mutex_unlock(&info->stage_mutex);
+	return stage;
+}
+
+/*
+ * Write out what is staged for @inode through open files other than the
+ * one of @self (all of them if NULL).  Errors go to fsync()/close() of
+ * the file they were staged through.
+ */
+static void wrapfs_stage_flush_others(struct inode *inode,
+				      struct wrapfs_stage *self)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+	struct wrapfs_stage *stage;
+
+	mutex_lock(&info->stage_mutex);
+	list_for_each_entry(stage, &info->stages, list) {
+		if (stage == self || !READ_ONCE(stage->len))
+			continue;
+		mutex_lock(&stage->mutex);
+		__wrapfs_stage_flush(stage);
+		mutex_unlock(&stage->mutex);
+	}
+	mutex_unlock(&info->stage_mutex);
+}
+
+/* write out whatever is staged for @inode */
+void wrapfs_stage_flush(struct inode *inode)
+{
+	if (!atomic_read(&WRAPFS_I(inode)->nr_staged))
+		return;
+	wrapfs_stage_flush_others(inode, NULL);
+}
+
+/* write out whatever is staged for @file's inode, report @file's errors */
+int wrapfs_stage_sync(struct file *file)
+{
+	struct wrapfs_stage *stage = smp_load_acquire(&WRAPFS_F(file)->stage);
+	int err;
+
+	wrapfs_stage_flush(file_inode(file));
+	if (!stage)
+		return 0;
+
+	mutex_lock(&stage->mutex);
+	err = stage->err;
+	stage->err = 0;
+	mutex_unlock(&stage->mutex);
+
+	return err;
+}
+
+/* write out everything staged on @sb, for sync and freeze */
+void wrapfs_stage_flush_sb(struct super_block *sb)
+{
+	struct inode *inode, *toput = NULL;
+
+	/* no buffers, nothing staged */
+	if (!atomic_long_read(&WRAPFS_SB(sb)->staging_used))
+		return;
+
+	spin_lock(&sb->s_inode_list_lock);
+	list_for_each_entry(inode, &sb->s_inodes, i_sb_list) {
+		if (!atomic_read(&WRAPFS_I(inode)->nr_staged))
+			continue;
+		spin_lock(&inode->i_lock);
+		if (inode->i_state & (I_FREEING | I_WILL_FREE | I_NEW)) {
+			spin_unlock(&inode->i_lock);
+			continue;
+		}
+		__iget(inode);
+		spin_unlock(&inode->i_lock);
+		spin_unlock(&sb->s_inode_list_lock);
+
+		wrapfs_stage_flush(inode);
+		/* not under s_inode_list_lock, and @inode keeps our place */
+		iput(toput);
+		toput = inode;
+
+		spin_lock(&sb->s_inode_list_lock);
+	}
+	spin_unlock(&sb->s_inode_list_lock);
+	iput(toput);
+}
+
+/*
+ * Stage a write of @from at *@ppos through @file.  Returns the number of
+ * bytes staged, a negative error, or 0 if the write is to go to the
+ * lower file as usual; anything staged before it has then been written
+ * out already.
+ */
+ssize_t wrapfs_stage_write(struct file *file, struct iov_iter *from,
+			   loff_t *ppos)
+{
+	struct inode *inode = file_inode(file);
+	struct wrapfs_sb_info *sbinfo = WRAPFS_SB(inode->i_sb);
+	size_t count = iov_iter_count(from);
+	struct wrapfs_stage *stage;
+	struct file *lower_file;
+	size_t copied;
+	loff_t pos;
+
+	if (!sbinfo->staging_max || !S_ISREG(inode->i_mode) ||
+	    !count || count > WRAPFS_STAGE_WRITE_MAX ||
+	    (file->f_flags & (O_DIRECT | O_DSYNC)) || IS_SYNC(inode))
+		goto out_direct;
+	lower_file = wrapfs_lower_file(file);
+	if (mapping_mapped(inode->i_mapping) ||
+	    mapping_mapped(lower_file->f_mapping))
+		goto out_direct;
+
+	stage = wrapfs_get_stage(file);
+	if (!stage)
+		goto out_direct;
+	/* keep the order of writes through different files */
+	if (atomic_read(&WRAPFS_I(inode)->nr_staged))
+		wrapfs_stage_flush_others(inode, stage);
+
+	mutex_lock(&stage->mutex);
+	pos = *ppos;
+	if (file->f_flags & O_APPEND) {
+		pos = i_size_read(file_inode(lower_file));
+		if (stage->len && stage->pos + stage->len > pos)
+			pos = stage->pos + stage->len;
+	}
+	if (pos + count > inode->i_sb->s_maxbytes)
+		goto out_unlock;
+
+	/* the buffer only grows at its end */
+	if (stage->len && (pos != stage->pos + stage->len ||
+			   stage->len + count > WRAPFS_STAGE_SIZE))
+		__wrapfs_stage_flush(stage);
+
+	if (!stage->buf) {
+		if (atomic_long_add_return(WRAPFS_STAGE_SIZE,
+					   &sbinfo->staging_used) >
+		    sbinfo->staging_max)
+			goto out_unaccount;
+		stage->buf = kmalloc(WRAPFS_STAGE_SIZE,
+				     GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN);
+		if (!stage->buf)
+			goto out_unaccount;
+	}
+
+	copied = copy_from_iter(stage->buf + stage->len, count, from);
+	if (!copied) {
+		mutex_unlock(&stage->mutex);
+		return -EFAULT;
+	}
+	if (!stage->len) {
+		stage->pos = pos;
+		atomic_inc(&WRAPFS_I(inode)->nr_staged);
+		queue_delayed_work(system_unbound_wq, &stage->work,
+				   WRAPFS_STAGE_DELAY);
+	}
+	stage->len += copied;
+	*ppos = pos + copied;
+	if (*ppos > i_size_read(inode))
+		i_size_write(inode, *ppos);
+	mutex_unlock(&stage->mutex);
+
+	wrapfs_attr_changed(inode);
+	return copied;
+
+out_unaccount:
+	atomic_long_sub(WRAPFS_STAGE_SIZE, &sbinfo->staging_used);
+out_unlock:
+	mutex_unlock(&stage->mutex);
+out_direct:
+	wrapfs_stage_flush(inode);
+	return 0;
+}
+
+/* @file is being closed; its ->flush has normally written it out already */
+void wrapfs_stage_release(struct file *file)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(file_inode(file));
+	struct wrapfs_stage *stage = WRAPFS_F(file)->stage;
+
+	if (!stage)
+		return;
+
+	cancel_delayed_work_sync(&stage->work);
+	mutex_lock(&info->stage_mutex);
+	mutex_lock(&stage->mutex);
+	__wrapfs_stage_flush(stage);
+	list_del(&stage->list);
+	mutex_unlock(&stage->mutex);
+	mutex_unlock(&info->stage_mutex);
+
+	if (stage->buf) {
+		kfree(stage->buf);
+		atomic_long_sub(WRAPFS_STAGE_SIZE,
+				&WRAPFS_SB(file_inode(file)->i_sb)->staging_used);
+	}
+	WRAPFS_F(file)->stage = NULL;
+	kfree(stage);
+}
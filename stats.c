@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 1998-2017 Erez Zadok
+ * Copyright (c) 2009	   Shrikar Archak
+ * Copyright (c) 2003-2017 Stony Brook University
+ * Copyright (c) 2003-2017 The Research Foundation of SUNY
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include "wrapfs.h"
+#include <linux/debugfs.h>
+#include <linux/kref.h>
+#include <linux/module.h>
+
+/*
+ * Operation counters.  Each mount has a set of per-CPU counters, bumped
+ * with wrapfs_stat_inc()/wrapfs_stat_add() without any shared cacheline
+ * or atomic op, and summed only when read through
+ * <debugfs>/wrapfs/<major>:<minor>, named after the mount's device
+ * number as shown in /proc/self/mountinfo.
+ */
+
+static const char * const wrapfs_stat_names[WRAPFS_STAT_NR] = {
+	[WRAPFS_STAT_LOOKUP]		= "lookups",
+	[WRAPFS_STAT_RULE_HIT]		= "rule_hits",
+	[WRAPFS_STAT_READDIR_FILTERED]	= "readdir_filtered",
+	[WRAPFS_STAT_OPEN]		= "opens",
+	[WRAPFS_STAT_READ]		= "reads",
+	[WRAPFS_STAT_READ_BYTES]	= "read_bytes",
+	[WRAPFS_STAT_WRITE]		= "writes",
+	[WRAPFS_STAT_WRITE_BYTES]	= "write_bytes",
+	[WRAPFS_STAT_GETATTR]		= "getattrs",
+	[WRAPFS_STAT_SETATTR]		= "setattrs",
+};
+
+/*
+ * The counters live in an object of their own rather than in the super
+ * block, so that the debugfs file never has to look at a super block,
+ * live or not: an open file holds a reference, and the counters are
+ * freed with the last one, after the umount if need be.
+ */
+struct wrapfs_stats_ref {
+	struct kref kref;
+	struct wrapfs_stats __percpu *stats;
+};
+
+static struct dentry *wrapfs_debugfs_root;
+static DEFINE_MUTEX(wrapfs_stats_mutex);	/* protects i_private */
+
+int wrapfs_stats_alloc(struct wrapfs_sb_info *sbinfo)
+{
+	struct wrapfs_stats_ref *ref;
+
+	ref = kmalloc(sizeof(*ref), GFP_KERNEL);
+	if (!ref)
+		return -ENOMEM;
+	ref->stats = alloc_percpu(struct wrapfs_stats);
+	if (!ref->stats) {
+		kfree(ref);
+		return -ENOMEM;
+	}
+	kref_init(&ref->kref);
+	sbinfo->stats_ref = ref;
+	sbinfo->stats = ref->stats;
+	return 0;
+}
+
+static void wrapfs_stats_free(struct kref *kref)
+{
+	struct wrapfs_stats_ref *ref =
+		container_of(kref, struct wrapfs_stats_ref, kref);
+
+	free_percpu(ref->stats);
+	kfree(ref);
+}
+
+/* the mount's reference; an open stats file may still hold another */
+void wrapfs_stats_put(struct wrapfs_sb_info *sbinfo)
+{
+	if (sbinfo->stats_ref)
+		kref_put(&sbinfo->stats_ref->kref, wrapfs_stats_free);
+	sbinfo->stats_ref = NULL;
+	sbinfo->stats = NULL;
+}
+
+static int wrapfs_stats_show(struct seq_file *m, void *v)
+{
+	struct wrapfs_stats_ref *ref = m->private;
+	unsigned long sum;
+	int i, cpu;
+
+	for (i = 0; i < WRAPFS_STAT_NR; i++) {
+		sum = 0;
+		for_each_possible_cpu(cpu)
+			sum += per_cpu_ptr(ref->stats, cpu)->count[i];
+		seq_printf(m, "%s %lu\n", wrapfs_stat_names[i], sum);
+	}
+	return 0;
+}
+
+static int wrapfs_stats_open(struct inode *inode, struct file *file)
+{
+	struct wrapfs_stats_ref *ref;
+	int err;
+
+	mutex_lock(&wrapfs_stats_mutex);
+	ref = inode->i_private;
+	if (ref)
+		kref_get(&ref->kref);
+	mutex_unlock(&wrapfs_stats_mutex);
+	if (!ref)
+		return -ENOENT;	/* unmounted meanwhile */
+
+	err = single_open(file, wrapfs_stats_show, ref);
+	if (err)
+		kref_put(&ref->kref, wrapfs_stats_free);
+	return err;
+}
+
+static int wrapfs_stats_release(struct inode *inode, struct file *file)
+{
+	struct wrapfs_stats_ref *ref =
+		((struct seq_file *)file->private_data)->private;
+	int err;
+
+	err = single_release(inode, file);
+	kref_put(&ref->kref, wrapfs_stats_free);
+	return err;
+}
+
+static const struct file_operations wrapfs_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= wrapfs_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= wrapfs_stats_release,
+};
+
+/* the counters themselves work without debugfs; only the file is missing */
+void wrapfs_stats_register(struct super_block *sb)
+{
+	char name[32];
+
+	if (IS_ERR_OR_NULL(wrapfs_debugfs_root))
+		return;
+
+	snprintf(name, sizeof(name), "%u:%u",
+		 MAJOR(sb->s_dev), MINOR(sb->s_dev));
+	WRAPFS_SB(sb)->stats_dentry =
+		debugfs_create_file(name, S_IRUSR, wrapfs_debugfs_root,
+				    WRAPFS_SB(sb)->stats_ref,
+				    &wrapfs_stats_fops);
+}
+
+void wrapfs_stats_unregister(struct super_block *sb)
+{
+	struct dentry *dentry = WRAPFS_SB(sb)->stats_dentry;
+
+	if (IS_ERR_OR_NULL(dentry))
+		return;
+	/* no new opens; those already in hold their own reference */
+	mutex_lock(&wrapfs_stats_mutex);
+	d_inode(dentry)->i_private = NULL;
+	mutex_unlock(&wrapfs_stats_mutex);
+	debugfs_remove(dentry);
+	WRAPFS_SB(sb)->stats_dentry = NULL;
+}
+
+void wrapfs_init_stats(void)
+{
+	wrapfs_debugfs_root = debugfs_create_dir(WRAPFS_NAME, NULL);
+}
+
+void wrapfs_destroy_stats(void)
+{
+	debugfs_remove_recursive(wrapfs_debugfs_root);
+}
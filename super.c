@@ -9,6 +9,7 @@
  * published by the Free Software Foundation.
  */
 
+#include <linux/parser.h>
 #include "wrapfs.h"
 
 /*
@@ -27,24 +28,82 @@ static void wrapfs_put_super(struct super_block *sb)
 	if (!spd)
 		return;
 
+	wrapfs_stats_unregister(sb);
+	cancel_work_sync(&spd->statfs_work);
+	path_put(&spd->statfs_root);
+	/* no inodes are left to queue fills or detach cache entries */
+	cancel_work_sync(&spd->cache_work);
+	srcu_barrier(&spd->cache_srcu);
+	cleanup_srcu_struct(&spd->cache_srcu);
+	wrapfs_cache_fini(spd);
 	wrapfs_hide_list_deinit(spd);
 	/* decrement lower super references */
 	s = wrapfs_lower_super(sb);
 	wrapfs_set_lower_super(sb, NULL);
 	atomic_dec(&s->s_active);
 
+	sb->s_bdi = &noop_backing_dev_info;
+	bdi_destroy(&spd->bdi);
+	wrapfs_stats_put(spd);
 	kfree(spd);
 	sb->s_fs_info = NULL;
 }
 
+static int wrapfs_statfs_fetch(struct wrapfs_sb_info *sbinfo,
+			       struct kstatfs *buf)
+{
+	int err;
+
+	err = vfs_statfs(&sbinfo->statfs_root, buf);
+	if (err)
+		return err;
+
+	spin_lock(&sbinfo->statfs_lock);
+	sbinfo->statfs = *buf;
+	sbinfo->statfs_expire = jiffies +
+		(unsigned long)sbinfo->statfs_timeout * HZ;
+	sbinfo->statfs_valid = true;
+	spin_unlock(&sbinfo->statfs_lock);
+	return 0;
+}
+
+/* a failed refresh leaves the old, expired, result to retry on */
+void wrapfs_statfs_work(struct work_struct *work)
+{
+	struct kstatfs buf;
+
+	wrapfs_statfs_fetch(container_of(work, struct wrapfs_sb_info,
+					 statfs_work), &buf);
+}
+
+/*
+ * With statfs_timeout= set, statfs is answered from a per-superblock
+ * copy of the lower result.  Once that is older than the timeout the
+ * caller still gets it, and a refresh is queued in the background, so
+ * only the very first statfs of a mount waits for the lower.
+ */
 static int wrapfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
 	int err;
+	bool cached = false;
+	struct wrapfs_sb_info *sbinfo = WRAPFS_SB(dentry->d_sb);
 	struct path lower_path;
 
-	wrapfs_get_lower_path(dentry, &lower_path);
-	err = vfs_statfs(&lower_path, buf);
-	wrapfs_put_lower_path(dentry, &lower_path);
+	if (sbinfo->statfs_timeout) {
+		spin_lock(&sbinfo->statfs_lock);
+		if (sbinfo->statfs_valid) {
+			*buf = sbinfo->statfs;
+			cached = true;
+			if (time_after_eq(jiffies, sbinfo->statfs_expire))
+				schedule_work(&sbinfo->statfs_work);
+		}
+		spin_unlock(&sbinfo->statfs_lock);
+		err = cached ? 0 : wrapfs_statfs_fetch(sbinfo, buf);
+	} else {
+		wrapfs_get_lower_path(dentry, &lower_path);
+		err = vfs_statfs(&lower_path, buf);
+		wrapfs_put_lower_path(dentry, &lower_path);
+	}
 
 	/* set return buf to our f/s to avoid confusing user-level utils */
 	buf->f_type = WRAPFS_SUPER_MAGIC;
@@ -52,6 +111,178 @@ static int wrapfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 	return err;
 }
 
+enum {
+	Opt_attr_sync_eager, Opt_attr_sync_lazy,
+	Opt_mmap_interpose, Opt_mmap_passthrough,
+	Opt_attr_timeout, Opt_statfs_timeout, Opt_readdir_prefetch,
+	Opt_cache_dir, Opt_cache_size, Opt_write_staging, Opt_readahead_kb,
+	Opt_err,
+};
+
+static const match_table_t wrapfs_tokens = {
+	{Opt_attr_sync_eager, "attr_sync=eager"},
+	{Opt_attr_sync_lazy, "attr_sync=lazy"},
+	{Opt_mmap_interpose, "mmap=interpose"},
+	{Opt_mmap_passthrough, "mmap=passthrough"},
+	{Opt_attr_timeout, "attr_timeout=%u"},
+	{Opt_statfs_timeout, "statfs_timeout=%u"},
+	{Opt_readdir_prefetch, "readdir_prefetch=%u"},
+	{Opt_cache_dir, "cache_dir=%s"},
+	{Opt_cache_size, "cache_size=%u"},
+	{Opt_write_staging, "write_staging=%u"},
+	{Opt_readahead_kb, "readahead_kb=%u"},
+	{Opt_err, NULL}
+};
+
+/*
+ * Parse the comma separated mount options in @options into @sb's
+ * private data.  Used both at mount and at remount time.
+ */
+int wrapfs_parse_options(struct super_block *sb, char *options)
+{
+	struct wrapfs_sb_info *sbinfo = WRAPFS_SB(sb);
+	substring_t args[MAX_OPT_ARGS];
+	int option, err;
+	struct path path;
+	char *p, *name;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+
+		switch (match_token(p, wrapfs_tokens, args)) {
+		case Opt_attr_sync_eager:
+			sbinfo->mount_flags &= ~WRAPFS_MOUNT_ATTR_LAZY;
+			break;
+		case Opt_attr_sync_lazy:
+			sbinfo->mount_flags |= WRAPFS_MOUNT_ATTR_LAZY;
+			break;
+		case Opt_mmap_interpose:
+			sbinfo->mount_flags &= ~WRAPFS_MOUNT_MMAP_PASSTHROUGH;
+			break;
+		case Opt_mmap_passthrough:
+			sbinfo->mount_flags |= WRAPFS_MOUNT_MMAP_PASSTHROUGH;
+			break;
+		case Opt_attr_timeout:
+			/* seconds, kept as jiffies: must not overflow */
+			if (match_int(&args[0], &option) || option < 0 ||
+			    option > MAX_JIFFY_OFFSET / HZ) {
+				printk(KERN_ERR
+				       "wrapfs: bad value for \"%s\"\n", p);
+				return -EINVAL;
+			}
+			sbinfo->attr_timeout = option;
+			break;
+		case Opt_statfs_timeout:
+			if (match_int(&args[0], &option) || option < 0 ||
+			    option > MAX_JIFFY_OFFSET / HZ) {
+				printk(KERN_ERR
+				       "wrapfs: bad value for \"%s\"\n", p);
+				return -EINVAL;
+			}
+			sbinfo->statfs_timeout = option;
+			break;
+		case Opt_readdir_prefetch:
+			if (match_int(&args[0], &option) || option < 0) {
+				printk(KERN_ERR
+				       "wrapfs: bad value for \"%s\"\n", p);
+				return -EINVAL;
+			}
+			sbinfo->readdir_prefetch = option;
+			break;
+		case Opt_cache_dir:
+			name = match_strdup(&args[0]);
+			if (!name)
+				return -ENOMEM;
+			if (!sb->s_root) {
+				err = wrapfs_cache_set_dir(sbinfo, name);
+				kfree(name);
+				if (err)
+					return err;
+				break;
+			}
+			/* remount: fine as long as it doesn't change */
+			err = kern_path(name, LOOKUP_FOLLOW, &path);
+			kfree(name);
+			if (!err) {
+				if (!path_equal(&path, &sbinfo->cache_path))
+					err = -EINVAL;
+				path_put(&path);
+			}
+			if (err) {
+				printk(KERN_ERR "wrapfs: cache_dir can't be "
+				       "changed on remount\n");
+				return -EINVAL;
+			}
+			break;
+		case Opt_cache_size:
+			if (match_int(&args[0], &option) || option < 0) {
+				printk(KERN_ERR
+				       "wrapfs: bad value for \"%s\"\n", p);
+				return -EINVAL;
+			}
+			sbinfo->cache_size = (loff_t)option << 20;
+			break;
+		case Opt_write_staging:
+			if (match_int(&args[0], &option) || option < 0) {
+				printk(KERN_ERR
+				       "wrapfs: bad value for \"%s\"\n", p);
+				return -EINVAL;
+			}
+			sbinfo->staging_max = (unsigned long)option << 10;
+			break;
+		case Opt_readahead_kb:
+			if (match_int(&args[0], &option) || option < 0) {
+				printk(KERN_ERR
+				       "wrapfs: bad value for \"%s\"\n", p);
+				return -EINVAL;
+			}
+			sbinfo->readahead_kb = option;
+			sbinfo->readahead_set = true;
+			break;
+		default:
+			printk(KERN_ERR
+			       "wrapfs: unrecognized mount option \"%s\"\n", p);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+static int wrapfs_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct super_block *sb = root->d_sb;
+
+	if (wrapfs_test_opt(sb, ATTR_LAZY))
+		seq_puts(m, ",attr_sync=lazy");
+	if (wrapfs_test_opt(sb, MMAP_PASSTHROUGH))
+		seq_puts(m, ",mmap=passthrough");
+	if (WRAPFS_SB(sb)->attr_timeout)
+		seq_printf(m, ",attr_timeout=%u", WRAPFS_SB(sb)->attr_timeout);
+	if (WRAPFS_SB(sb)->statfs_timeout)
+		seq_printf(m, ",statfs_timeout=%u",
+			   WRAPFS_SB(sb)->statfs_timeout);
+	if (WRAPFS_SB(sb)->readdir_prefetch)
+		seq_printf(m, ",readdir_prefetch=%u",
+			   WRAPFS_SB(sb)->readdir_prefetch);
+	if (WRAPFS_SB(sb)->cache_path.mnt) {
+		seq_puts(m, ",cache_dir=");
+		seq_path(m, &WRAPFS_SB(sb)->cache_path, ", \t\n\\");
+	}
+	if (WRAPFS_SB(sb)->cache_size)
+		seq_printf(m, ",cache_size=%llu",
+			   (unsigned long long)WRAPFS_SB(sb)->cache_size >> 20);
+	if (WRAPFS_SB(sb)->staging_max)
+		seq_printf(m, ",write_staging=%lu",
+			   WRAPFS_SB(sb)->staging_max >> 10);
+	if (WRAPFS_SB(sb)->readahead_set)
+		seq_printf(m, ",readahead_kb=%u", WRAPFS_SB(sb)->readahead_kb);
+	return 0;
+}
+
 /*
  * @flags: numeric mount options
  * @options: mount options string
@@ -70,6 +301,11 @@ static int wrapfs_remount_fs(struct super_block *sb, int *flags, char *options)
 		       "wrapfs: remount flags 0x%x unsupported\n", *flags);
 		err = -EINVAL;
 	}
+	if (!err)
+		err = wrapfs_parse_options(sb, options);
+	/* for files opened from now on */
+	if (!err)
+		wrapfs_set_readahead(sb);
 
 	return err;
 }
@@ -86,6 +322,8 @@ static void wrapfs_evict_inode(struct inode *inode)
 
 	truncate_inode_pages(&inode->i_data, 0);
 	clear_inode(inode);
+	wrapfs_xattr_cache_clear(inode);
+	wrapfs_cache_drop(inode);
 	/*
 	 * Decrement a reference to a lower_inode, which was incremented
 	 * by our read_inode when it was created initially.
@@ -105,16 +343,33 @@ static struct inode *wrapfs_alloc_inode(struct super_block *sb)
 
 	/* memset everything up to the inode to 0 */
 	memset(i, 0, offsetof(struct wrapfs_inode_info, vfs_inode));
+	spin_lock_init(&i->lock);
+	INIT_LIST_HEAD(&i->xattrs);
+	i->attr_expire = jiffies;
+	i->cache_retry = jiffies;
+	mutex_init(&i->stage_mutex);
+	INIT_LIST_HEAD(&i->stages);
 
 	i->vfs_inode.i_version = 1;
 	return &i->vfs_inode;
 }
 
-static void wrapfs_destroy_inode(struct inode *inode)
+static void wrapfs_i_callback(struct rcu_head *head)
 {
+	struct inode *inode = container_of(head, struct inode, i_rcu);
+
+	/* cached symlink body, see wrapfs_get_link() */
+	if (S_ISLNK(inode->i_mode))
+		kfree(inode->i_link);
 	kmem_cache_free(wrapfs_inode_cachep, WRAPFS_I(inode));
 }
 
+/* RCU-walk may still be looking at the inode */
+static void wrapfs_destroy_inode(struct inode *inode)
+{
+	call_rcu(&inode->i_rcu, wrapfs_i_callback);
+}
+
 /* wrapfs inode cache constructor */
 static void init_once(void *obj)
 {
@@ -139,8 +394,57 @@ int wrapfs_init_inode_cache(void)
 /* wrapfs inode cache destructor */
 void wrapfs_destroy_inode_cache(void)
 {
-	if (wrapfs_inode_cachep)
+	if (wrapfs_inode_cachep) {
+		/* wait for pending wrapfs_i_callback() calls */
+		rcu_barrier();
 		kmem_cache_destroy(wrapfs_inode_cachep);
+	}
+}
+
+/*
+ * syncfs() and freeze only see wrapfs's own inodes, which hold no data,
+ * so sync the lower super block instead.  sync_filesystem() on the
+ * lower already waits for everything, so do it only for the waiting
+ * pass.
+ */
+static int wrapfs_sync_fs(struct super_block *sb, int wait)
+{
+	int err;
+	struct super_block *lower_sb;
+
+	/* staged writes go to the lower before it is synced */
+	wrapfs_stage_flush_sb(sb);
+	if (!wait)
+		return 0;
+
+	lower_sb = wrapfs_lower_super(sb);
+	down_read(&lower_sb->s_umount);
+	err = sync_filesystem(lower_sb);
+	up_read(&lower_sb->s_umount);
+
+	return err;
+}
+
+/*
+ * Freezing wrapfs quiesces the lower file system as well, so a frozen
+ * wrapfs is a consistent point of the data it exposes.  Called with
+ * our own writers already drained by freeze_super().
+ */
+static int wrapfs_freeze_fs(struct super_block *sb)
+{
+	wrapfs_stage_flush_sb(sb);
+	return freeze_super(wrapfs_lower_super(sb));
+}
+
+static int wrapfs_unfreeze_fs(struct super_block *sb)
+{
+	int err;
+
+	err = thaw_super(wrapfs_lower_super(sb));
+	/* somebody thawed the lower directly: don't leave us frozen */
+	if (err == -EINVAL)
+		err = 0;
+	return err;
 }
 
 /*
@@ -158,52 +462,278 @@ static void wrapfs_umount_begin(struct super_block *sb)
 
 const struct super_operations wrapfs_sops = {
 	.put_super	= wrapfs_put_super,
+	.sync_fs	= wrapfs_sync_fs,
+	.freeze_fs	= wrapfs_freeze_fs,
+	.unfreeze_fs	= wrapfs_unfreeze_fs,
 	.statfs		= wrapfs_statfs,
 	.remount_fs	= wrapfs_remount_fs,
 	.evict_inode	= wrapfs_evict_inode,
 	.umount_begin	= wrapfs_umount_begin,
-	.show_options	= generic_show_options,
+	.show_options	= wrapfs_show_options,
 	.alloc_inode	= wrapfs_alloc_inode,
 	.destroy_inode	= wrapfs_destroy_inode,
 	.drop_inode	= generic_delete_inode,
 };
 
-/* NFS support */
+/*
+ * NFS support
+ *
+ * A wrapfs file handle is the lower file system's own handle, with its
+ * type stored in the first word, so decoding goes through the lower
+ * exportfs ops and works whether or not the lower inode is cached.
+ * Lower file systems that can't decode handles get plain inode number
+ * handles, which (like handles issued before WRAPFS_FILEID existed) can
+ * only be resolved while the lower inode is in cache.
+ */
+#define WRAPFS_FILEID	0x57
 
-static struct inode *wrapfs_nfs_get_inode(struct super_block *sb, u64 ino,
-					  u32 generation)
+static int wrapfs_encode_ino_fh(struct inode *lower_inode, __u32 *fh,
+				int *max_len, struct inode *lower_parent)
 {
-	struct super_block *lower_sb;
+	int len = lower_parent ? 4 : 2;
+
+	if (*max_len < len) {
+		*max_len = len;
+		return FILEID_INVALID;
+	}
+	fh[0] = lower_inode->i_ino;
+	fh[1] = lower_inode->i_generation;
+	if (lower_parent) {
+		fh[2] = lower_parent->i_ino;
+		fh[3] = lower_parent->i_generation;
+	}
+	*max_len = len;
+	return lower_parent ? FILEID_INO32_GEN_PARENT : FILEID_INO32_GEN;
+}
+
+static int wrapfs_encode_fh(struct inode *inode, __u32 *fh, int *max_len,
+			    struct inode *parent)
+{
+	struct inode *lower_inode = wrapfs_lower_inode(inode);
+	struct inode *lower_parent = NULL;
+	const struct export_operations *lower_nop;
+	int lower_len, type;
+
+	if (parent)
+		lower_parent = wrapfs_lower_inode(parent);
+	lower_nop = lower_inode->i_sb->s_export_op;
+	if (!lower_nop || !lower_nop->fh_to_dentry)
+		return wrapfs_encode_ino_fh(lower_inode, fh, max_len,
+					    lower_parent);
+
+	lower_len = *max_len > 1 ? *max_len - 1 : 0;
+	type = exportfs_encode_inode_fh(lower_inode, (struct fid *)(fh + 1),
+					&lower_len, lower_parent);
+	*max_len = lower_len + 1;
+	if (type == FILEID_INVALID)
+		return FILEID_INVALID;
+	fh[0] = type;
+	return WRAPFS_FILEID;
+}
+
+/*
+ * Find or make the upper dentry for a decoded lower dentry, which may be
+ * disconnected.  Consumes the reference on @lower_dentry.
+ *
+ * Every upper dentry others can find must already have its lower path,
+ * since its users don't take d_lock.  d_obtain_alias() would publish
+ * the new dentry on the inode's alias list first, so it is open-coded
+ * here: the disconnected dentry is set up privately, then instantiated
+ * with d_instantiate_no_diralias(), which like d_obtain_alias() checks
+ * under i_lock that a directory has no alias yet, and put on s_anon.
+ */
+static struct dentry *wrapfs_obtain_alias(struct super_block *sb,
+					  struct dentry *lower_dentry)
+{
+	static const struct qstr anon = QSTR_INIT("/", 1);
+	int err;
 	struct inode *inode;
+	struct dentry *dentry;
+	struct path lower_path;
+
+	if (IS_ERR_OR_NULL(lower_dentry))
+		return lower_dentry ? lower_dentry : ERR_PTR(-ESTALE);
+	if (d_really_is_negative(lower_dentry) ||
+	    d_inode(lower_dentry)->i_sb != wrapfs_lower_super(sb)) {
+		err = -ESTALE;
+		goto out_dput;
+	}
+	/* what lookup would refuse, handles refuse too */
+	if (wrapfs_ino_is_blocked(WRAPFS_SB(sb),
+				  d_inode(lower_dentry)->i_ino)) {
+		err = -ESTALE;
+		goto out_dput;
+	}
+
+	inode = wrapfs_iget(sb, d_inode(lower_dentry));
+	if (IS_ERR(inode)) {
+		err = PTR_ERR(inode);
+		goto out_dput;
+	}
+
+retry:
+	dentry = d_find_any_alias(inode);
+	if (dentry)
+		goto out;
+
+	dentry = d_alloc_pseudo(sb, &anon);
+	if (!dentry) {
+		err = -ENOMEM;
+		goto out_iput;
+	}
+	err = new_dentry_private_data(dentry);
+	if (err) {
+		dput(dentry);
+		goto out_iput;
+	}
+	lower_path.dentry = dget(lower_dentry);
+	lower_path.mnt = mntget(WRAPFS_D(sb->s_root)->lower_path.mnt);
+	wrapfs_set_lower_path(dentry, &lower_path);
+	spin_lock(&dentry->d_lock);
+	dentry->d_flags |= DCACHE_DISCONNECTED;
+	spin_unlock(&dentry->d_lock);
+
+	/* the dentry gets a reference of its own; it is dropped on -EBUSY */
+	ihold(inode);
+	if (d_instantiate_no_diralias(dentry, inode)) {
+		/* the directory was found by a lookup meanwhile */
+		dput(dentry);
+		goto retry;
+	}
+	spin_lock(&dentry->d_lock);
+	hlist_bl_lock(&sb->s_anon);
+	hlist_bl_add_head(&dentry->d_hash, &sb->s_anon);
+	hlist_bl_unlock(&sb->s_anon);
+	spin_unlock(&dentry->d_lock);
+
+out:
+	iput(inode);
+	dput(lower_dentry);
+	return dentry;
+
+out_iput:
+	iput(inode);
+out_dput:
+	dput(lower_dentry);
+	return ERR_PTR(err);
+}
+
+static struct dentry *wrapfs_decode_fh(struct super_block *sb,
+				       struct fid *fid, int fh_len,
+				       bool parent)
+{
+	struct super_block *lower_sb = wrapfs_lower_super(sb);
+	const struct export_operations *lower_nop = lower_sb->s_export_op;
+	struct fid *lower_fid = (struct fid *)(fid->raw + 1);
+	int lower_type = fid->raw[0];
+	struct dentry *lower_dentry;
+
+	if (fh_len < 2 || !lower_nop)
+		return ERR_PTR(-ESTALE);
+
+	if (!parent)
+		lower_dentry = lower_nop->fh_to_dentry(lower_sb, lower_fid,
+						       fh_len - 1, lower_type);
+	else if (lower_nop->fh_to_parent)
+		lower_dentry = lower_nop->fh_to_parent(lower_sb, lower_fid,
+						       fh_len - 1, lower_type);
+	else
+		lower_dentry = NULL;
+
+	return wrapfs_obtain_alias(sb, lower_dentry);
+}
+
+/* inode number handles: only resolvable while the lower inode is cached */
+static struct dentry *wrapfs_decode_ino_fh(struct super_block *sb,
+					   u32 ino, u32 generation)
+{
 	struct inode *lower_inode;
 
-	lower_sb = wrapfs_lower_super(sb);
-	lower_inode = ilookup(lower_sb, ino);
-	inode = wrapfs_iget(sb, lower_inode);
-	return inode;
+	lower_inode = ilookup(wrapfs_lower_super(sb), ino);
+	if (!lower_inode)
+		return ERR_PTR(-ESTALE);
+	if (generation && lower_inode->i_generation != generation) {
+		iput(lower_inode);
+		return ERR_PTR(-ESTALE);
+	}
+	return wrapfs_obtain_alias(sb, d_obtain_alias(lower_inode));
 }
 
 static struct dentry *wrapfs_fh_to_dentry(struct super_block *sb,
 					  struct fid *fid, int fh_len,
 					  int fh_type)
 {
-	return generic_fh_to_dentry(sb, fid, fh_len, fh_type,
-				    wrapfs_nfs_get_inode);
+	switch (fh_type) {
+	case WRAPFS_FILEID:
+		return wrapfs_decode_fh(sb, fid, fh_len, false);
+	case FILEID_INO32_GEN:
+	case FILEID_INO32_GEN_PARENT:
+		if (fh_len < 2)
+			break;
+		return wrapfs_decode_ino_fh(sb, fid->i32.ino, fid->i32.gen);
+	}
+	return NULL;
 }
 
 static struct dentry *wrapfs_fh_to_parent(struct super_block *sb,
 					  struct fid *fid, int fh_len,
 					  int fh_type)
 {
-	return generic_fh_to_parent(sb, fid, fh_len, fh_type,
-				    wrapfs_nfs_get_inode);
+	switch (fh_type) {
+	case WRAPFS_FILEID:
+		return wrapfs_decode_fh(sb, fid, fh_len, true);
+	case FILEID_INO32_GEN_PARENT:
+		if (fh_len < 4)
+			break;
+		return wrapfs_decode_ino_fh(sb, fid->i32.parent_ino,
+					    fid->i32.parent_gen);
+	}
+	return NULL;
+}
+
+/*
+ * Reconnecting a disconnected directory walks up the lower tree, which
+ * may leave the part of it we are mounted on; such handles are stale.
+ */
+static struct dentry *wrapfs_get_parent(struct dentry *child)
+{
+	struct super_block *sb = child->d_sb;
+	struct super_block *lower_sb = wrapfs_lower_super(sb);
+	struct dentry *lower_dentry, *lower_parent, *parent;
+	struct path lower_path;
+
+	wrapfs_get_lower_path(child, &lower_path);
+	lower_dentry = lower_path.dentry;
+	if (!IS_ROOT(lower_dentry))
+		lower_parent = dget_parent(lower_dentry);
+	else if (lower_sb->s_export_op && lower_sb->s_export_op->get_parent)
+		lower_parent = lower_sb->s_export_op->get_parent(lower_dentry);
+	else
+		lower_parent = ERR_PTR(-EACCES);
+	wrapfs_put_lower_path(child, &lower_path);
+	if (IS_ERR(lower_parent))
+		return lower_parent;
+
+	if (lower_parent == WRAPFS_D(sb->s_root)->lower_path.dentry) {
+		parent = dget(sb->s_root);
+		dput(lower_parent);
+	} else if (lower_parent == lower_sb->s_root) {
+		parent = ERR_PTR(-ESTALE);
+		dput(lower_parent);
+	} else {
+		parent = wrapfs_obtain_alias(sb, lower_parent);
+	}
+	return parent;
 }
 
 /*
- * all other funcs are default as defined in exportfs/expfs.c
+ * get_name is the default one from exportfs/expfs.c, which goes
+ * through our readdir and so never reconnects through hidden entries.
  */
 
 const struct export_operations wrapfs_export_ops = {
+	.encode_fh	   = wrapfs_encode_fh,
 	.fh_to_dentry	   = wrapfs_fh_to_dentry,
-	.fh_to_parent	   = wrapfs_fh_to_parent
+	.fh_to_parent	   = wrapfs_fh_to_parent,
+	.get_parent	   = wrapfs_get_parent,
 };
@@ -27,9 +27,15 @@
 #include <linux/slab.h>
 #include <linux/sched.h>
 #include <linux/xattr.h>
+#include <linux/posix_acl.h>
+#include <linux/posix_acl_xattr.h>
 #include <linux/exportfs.h>
 #include <linux/hashtable.h>
 #include <linux/list.h>
+#include <linux/workqueue.h>
+#include <linux/backing-dev.h>
+#include <linux/percpu.h>
+#include <linux/srcu.h>
 
 #define WRAPFS_SUPER_MAGIC      0xb550ca10
 
@@ -48,8 +54,90 @@ struct wrapfs_sb_info {
 	struct super_block *lower_sb;
 	DECLARE_HASHTABLE(hlist, 4);
 	spinlock_t hlock;
+	unsigned int mount_flags;
+	unsigned int attr_timeout;	/* seconds, 0: always ask the lower */
+
+	/* statfs cache, see wrapfs_statfs() */
+	unsigned int statfs_timeout;	/* seconds, 0: no caching */
+	struct path statfs_root;	/* lower root, for the refresh work */
+	spinlock_t statfs_lock;		/* protects the three below */
+	bool statfs_valid;
+	unsigned long statfs_expire;	/* jiffies */
+	struct kstatfs statfs;
+	struct work_struct statfs_work;
+
+	unsigned int readdir_prefetch;	/* max lookups in flight, 0: off */
+	spinlock_t prefetch_lock;	/* protects the three below */
+	struct list_head prefetch_dirs;	/* see prefetch.c */
+	unsigned int prefetch_queued;	/* names on prefetch_dirs */
+	unsigned int prefetch_workers;
+	wait_queue_head_t prefetch_wait;	/* for prefetch_workers == 0 */
+
+	/* read-through cache, see cache.c */
+	struct path cache_path;		/* cache_dir= */
+	const struct cred *cache_cred;	/* of the mounter */
+	loff_t cache_size;		/* cache_size=, in bytes */
+	spinlock_t cache_lock;		/* protects the three below */
+	loff_t cache_used;		/*  and inode cache entries */
+	struct list_head cache_lru;
+	struct list_head cache_fills;	/* entries to fill */
+	struct work_struct cache_work;	/* fills them */
+	struct srcu_struct cache_srcu;	/* frees entries */
+
+	unsigned long staging_max;	/* write_staging=, in bytes */
+	atomic_long_t staging_used;	/* see staging.c */
+
+	unsigned int readahead_kb;	/* if readahead_set */
+	bool readahead_set;		/* else: the lower's */
+	struct backing_dev_info bdi;	/* for upper files' readahead */
+
+	struct wrapfs_stats __percpu *stats;
+	struct wrapfs_stats_ref *stats_ref;	/* owns stats */
+	struct dentry *stats_dentry;	/* in debugfs */
+};
+
+struct wrapfs_cache_entry;
+struct wrapfs_stage;
+struct wrapfs_stats_ref;
+struct wrapfs_prefetch_dir;
+
+static inline bool wrapfs_cache_enabled(struct wrapfs_sb_info *sbinfo)
+{
+	return sbinfo->cache_path.mnt && sbinfo->cache_size;
+}
+
+/* per-CPU operation counters, see stats.c */
+enum wrapfs_stat {
+	WRAPFS_STAT_LOOKUP,
+	WRAPFS_STAT_RULE_HIT,		/* hide/block rule matched */
+	WRAPFS_STAT_READDIR_FILTERED,
+	WRAPFS_STAT_OPEN,
+	WRAPFS_STAT_READ,
+	WRAPFS_STAT_READ_BYTES,
+	WRAPFS_STAT_WRITE,
+	WRAPFS_STAT_WRITE_BYTES,
+	WRAPFS_STAT_GETATTR,
+	WRAPFS_STAT_SETATTR,
+	WRAPFS_STAT_NR
 };
 
+struct wrapfs_stats {
+	unsigned long count[WRAPFS_STAT_NR];
+};
+
+/* data handed from wrapfs_mount() to wrapfs_read_super() */
+struct wrapfs_mount_data {
+	const char *dev_name;
+	void *raw_data;
+};
+
+/* mount options (wrapfs_sb_info->mount_flags) */
+#define WRAPFS_MOUNT_ATTR_LAZY	(1 << 0)
+#define WRAPFS_MOUNT_MMAP_PASSTHROUGH	(1 << 1)
+
+#define wrapfs_test_opt(sb, opt) \
+	(WRAPFS_SB(sb)->mount_flags & WRAPFS_MOUNT_##opt)
+
 struct wrapfs_ioctl {
 	unsigned long ino;
 	char path[MAXNAMELEN];
@@ -94,6 +182,7 @@ void wrapfs_remove_hnode(struct wrapfs_sb_info *sbinfo, const char *path,
 			 unsigned long ino);
 int wrapfs_is_blocked(struct wrapfs_sb_info *sbinfo, const char *path,
 		      unsigned long inode);
+int wrapfs_ino_is_blocked(struct wrapfs_sb_info *sbinfo, unsigned long ino);
 void wrapfs_hide_list_deinit(struct wrapfs_sb_info *sbinfo);
 unsigned long wrapfs_get_list_size(struct wrapfs_sb_info *sbinfo);
 int wrapfs_get_list(struct wrapfs_sb_info *sbinfo, void __user *buf);
@@ -108,6 +197,8 @@ extern const struct super_operations wrapfs_sops;
 extern const struct dentry_operations wrapfs_dops;
 extern const struct address_space_operations wrapfs_aops, wrapfs_dummy_aops;
 extern const struct vm_operations_struct wrapfs_vm_ops;
+extern int wrapfs_init_lower_vma(struct vm_area_struct *vma,
+				 struct file *lower_file);
 extern const struct export_operations wrapfs_export_ops;
 extern const struct xattr_handler *wrapfs_xattr_handlers[];
 
@@ -115,6 +206,8 @@ extern int wrapfs_init_inode_cache(void);
 extern void wrapfs_destroy_inode_cache(void);
 extern int wrapfs_init_dentry_cache(void);
 extern void wrapfs_destroy_dentry_cache(void);
+extern int wrapfs_init_aio_cache(void);
+extern void wrapfs_destroy_aio_cache(void);
 extern int new_dentry_private_data(struct dentry *dentry);
 extern void free_dentry_private_data(struct dentry *dentry);
 extern struct dentry *wrapfs_lookup(struct inode *dir, struct dentry *dentry,
@@ -123,16 +216,67 @@ extern struct inode *wrapfs_iget(struct super_block *sb,
 				 struct inode *lower_inode);
 extern int wrapfs_interpose(struct dentry *dentry, struct super_block *sb,
 			    struct path *lower_path);
+extern int wrapfs_finish_open(struct file *file, struct dentry *dentry,
+			      struct file *lower_file, int *opened);
+extern int wrapfs_parse_options(struct super_block *sb, char *options);
+extern void wrapfs_statfs_work(struct work_struct *work);
+extern void wrapfs_refresh_attrs(struct inode *inode);
+extern void wrapfs_xattr_cache_clear(struct inode *inode);
+extern void wrapfs_prefetch(struct file *file,
+			    struct wrapfs_prefetch_dir **pdp,
+			    const char *name, int len);
+extern void wrapfs_prefetch_submit(struct file *file,
+				   struct wrapfs_prefetch_dir *pd);
+extern void wrapfs_prefetch_wait(struct wrapfs_sb_info *sbinfo);
+extern struct file *wrapfs_cache_get(struct file *file, int *idx);
+extern void wrapfs_cache_put(struct file *file, int idx);
+extern void wrapfs_cache_work(struct work_struct *work);
+extern void wrapfs_cache_drop(struct inode *inode);
+extern void wrapfs_cache_invalidate(struct inode *inode);
+extern int wrapfs_cache_set_dir(struct wrapfs_sb_info *sbinfo,
+				const char *name);
+extern void wrapfs_cache_fini(struct wrapfs_sb_info *sbinfo);
+extern ssize_t wrapfs_stage_write(struct file *file, struct iov_iter *from,
+				  loff_t *ppos);
+extern void wrapfs_stage_flush(struct inode *inode);
+extern int wrapfs_stage_sync(struct file *file);
+extern void wrapfs_stage_flush_sb(struct super_block *sb);
+extern void wrapfs_stage_release(struct file *file);
+extern int wrapfs_stats_alloc(struct wrapfs_sb_info *sbinfo);
+extern void wrapfs_stats_put(struct wrapfs_sb_info *sbinfo);
+extern void wrapfs_stats_register(struct super_block *sb);
+extern void wrapfs_stats_unregister(struct super_block *sb);
+extern void wrapfs_init_stats(void);
+extern void wrapfs_destroy_stats(void);
+extern int wrapfs_init_prefetch(void);
+extern void wrapfs_destroy_prefetch(void);
 
 /* file private data */
 struct wrapfs_file_info {
 	struct file *lower_file;
 	const struct vm_operations_struct *lower_vm_ops;
+	struct wrapfs_stage *stage;	/* see staging.c */
+	struct file *lower_shared;	/* the inode's lower_ro_file we use */
 };
 
 /* wrapfs inode data in memory */
 struct wrapfs_inode_info {
 	struct inode *lower_inode;
+	spinlock_t lock;		/* protects all but lower_inode */
+	struct timespec cache_ctime;	/* lower ctime of cached xattrs */
+	struct list_head xattrs;	/* see wrapfs_getxattr() */
+	unsigned int nr_xattrs;
+	unsigned long xattr_gen;	/* bumped when the list is dropped */
+	unsigned long attr_expire;	/* jiffies, see wrapfs_getattr() */
+	unsigned long attr_gen;		/* bumped by wrapfs_attr_changed() */
+	struct wrapfs_cache_entry *cache; /* see cache.c */
+	unsigned long cache_retry;	/* jiffies, no cache fill before */
+	unsigned int cache_stale;	/* times the cache went stale */
+	struct mutex stage_mutex;	/* protects stages, see staging.c */
+	struct list_head stages;	/* of the open files */
+	atomic_t nr_staged;		/* of them holding data */
+	struct file *lower_ro_file;	/* shared by read-only opens */
+	unsigned int lower_ro_users;	/*  and how many use it */
 	struct inode vfs_inode;
 };
 
@@ -140,6 +284,7 @@ struct wrapfs_inode_info {
 struct wrapfs_dentry_info {
 	spinlock_t lock;	/* protects lower_path */
 	struct path lower_path;
+	struct rcu_head rcu;	/* freed after RCU-walk is done with it */
 };
 
 /*
@@ -174,12 +319,45 @@ static inline void wrapfs_set_lower_file(struct file *f, struct file *val)
 	WRAPFS_F(f)->lower_file = val;
 }
 
+/*
+ * file to lower file, opening the lower file on first use.  Read-only
+ * opens defer the lower open, so anything that needs the lower file of
+ * such a file must come through here rather than wrapfs_lower_file(),
+ * which returns NULL until then.
+ */
+extern struct file *__wrapfs_open_lower(struct file *f);
+
+static inline struct file *wrapfs_open_lower(struct file *f)
+{
+	struct file *lower_file = smp_load_acquire(&WRAPFS_F(f)->lower_file);
+
+	if (likely(lower_file))
+		return lower_file;
+	return __wrapfs_open_lower(f);
+}
+
 /* inode to lower inode. */
 static inline struct inode *wrapfs_lower_inode(const struct inode *i)
 {
 	return WRAPFS_I(i)->lower_inode;
 }
 
+/*
+ * attr_timeout=: let getattr answer from the upper inode again only
+ * after it has asked the lower, for anything wrapfs changes itself.
+ */
+static inline void wrapfs_attr_changed(struct inode *inode)
+{
+	struct wrapfs_inode_info *info = WRAPFS_I(inode);
+
+	if (!WRAPFS_SB(inode->i_sb)->attr_timeout)
+		return;
+	spin_lock(&info->lock);
+	info->attr_gen++;
+	info->attr_expire = jiffies;
+	spin_unlock(&info->lock);
+}
+
 static inline void wrapfs_set_lower_inode(struct inode *i, struct inode *val)
 {
 	WRAPFS_I(i)->lower_inode = val;
@@ -198,6 +376,43 @@ static inline void wrapfs_set_lower_super(struct super_block *sb,
 	WRAPFS_SB(sb)->lower_sb = val;
 }
 
+static inline void wrapfs_stat_inc(struct wrapfs_sb_info *sbinfo,
+				   enum wrapfs_stat item)
+{
+	this_cpu_inc(sbinfo->stats->count[item]);
+}
+
+static inline void wrapfs_stat_add(struct wrapfs_sb_info *sbinfo,
+				   enum wrapfs_stat item, unsigned long val)
+{
+	this_cpu_add(sbinfo->stats->count[item], val);
+}
+
+/* readahead window of new files: readahead_kb= or the lower's own */
+static inline void wrapfs_set_readahead(struct super_block *sb)
+{
+	struct wrapfs_sb_info *sbinfo = WRAPFS_SB(sb);
+
+	if (sbinfo->readahead_set)
+		sbinfo->bdi.ra_pages =
+			sbinfo->readahead_kb >> (PAGE_SHIFT - 10);
+	else
+		sbinfo->bdi.ra_pages = wrapfs_lower_super(sb)->s_bdi->ra_pages;
+}
+
+/*
+ * Like fsstack_copy_attr_atime(), but only store into the upper inode
+ * when the lower atime actually moved.  Readers sharing one file would
+ * otherwise bounce the upper inode's cacheline on every read, although
+ * with relatime the value rarely changes; getattr pulls it anyway.
+ */
+static inline void wrapfs_copy_attr_atime(struct inode *dest,
+					  const struct inode *src)
+{
+	if (!timespec_equal(&dest->i_atime, &src->i_atime))
+		dest->i_atime = src->i_atime;
+}
+
 /* path based (dentry/mnt) macros */
 static inline void pathcpy(struct path *dst, const struct path *src)
 {